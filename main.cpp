@@ -2,17 +2,62 @@
 
 // PVS-Studio Static Code Analyzer for C, C++ and C#: http://www.viva64.com
 
+////////////////////////////////////////////////////////////////////////////////
+//
+//	soalloc_bench
+//	Runs every workload with soalloc and with the global operator new and
+//	reports throughput, latency percentiles and memory usage
+//
+//	usage: soalloc_bench [--json FILE] [--scale X] [--threads N] [--only NAME]
+//		[--stats] [--trim]
+//	--stats dumps the soalloc counters after every run, it needs a build
+//		with SOALLOC_STATS
+//	--trim gives free memory back before the final RSS is read, through
+//		ThreadHeap::Trim, and malloc_trim with glibc
+//
+////////////////////////////////////////////////////////////////////////////////
+
 #include <iostream>
+#include <fstream>
+#include <iomanip>
 #include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <string>
+#include <map>
+#include <set>
+#include <list>
+#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include "soalloc.h"
+
+#if defined(_WIN32)
 #include <windows.h>
 #include <psapi.h>
-#include "soalloc.h"
+#elif defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#ifndef SOALLOC_REVISION
+#define SOALLOC_REVISION "unknown"
+#endif
 
 class Stopwatch final
 {
 public:
 
-	using elapsed_resolution = std::chrono::milliseconds;
+	using elapsed_resolution = std::chrono::duration<double>;
 
 	Stopwatch()
 	{
@@ -31,161 +76,790 @@ public:
 
 private:
 
-	std::chrono::high_resolution_clock clock;
-	std::chrono::high_resolution_clock::time_point reset_time;
+	std::chrono::steady_clock clock;
+	std::chrono::steady_clock::time_point reset_time;
 };
 
-/* standard: 100 000
-WorkingSetSize: 6746112
-23.6573 msec.
-1 000 000
-WorkingSetSize: 42962944
-159.186 msec.
+////////////////////////////////////////////////////////////////////////////////
+// Memory usage of the process in kB, 0 where it cannot be measured
+////////////////////////////////////////////////////////////////////////////////
 
-soalloc: 100 000
-WorkingSetSize: 5414912
-23.0391 msec.
-1 000 000
-WorkingSetSize: 27582464
-381.049 msec.
+struct MemoryUsage
+{
+	long peakRss;
+	long rss;
+};
 
-Optimizations:
-WorkingSetSize: 27561984
-183.352 msec.
+MemoryUsage GetMemoryUsage()
+{
+	MemoryUsage usage = { 0, 0 };
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (::GetProcessMemoryInfo(::GetCurrentProcess(), &pmc, sizeof(pmc)))
+	{
+		usage.peakRss = static_cast<long>(pmc.PeakWorkingSetSize / 1024);
+		usage.rss = static_cast<long>(pmc.WorkingSetSize / 1024);
+	}
+#else
+	if (FILE* f = std::fopen("/proc/self/status", "r"))
+	{
+		char line[256];
+		while (std::fgets(line, sizeof(line), f))
+		{
+			if (!std::strncmp(line, "VmHWM:", 6)) usage.peakRss = std::atol(line + 6);
+			else if (!std::strncmp(line, "VmRSS:", 6)) usage.rss = std::atol(line + 6);
+		}
+		std::fclose(f);
+	}
+#endif
+	return usage;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Test objects: the same payload allocated through soalloc or operator new
+////////////////////////////////////////////////////////////////////////////////
+
+template <std::size_t N>
+struct Pooled : public soalloc<Pooled<N>>
+{
+	unsigned char data[N];
+};
+
+template <std::size_t N>
+struct Plain
+{
+	unsigned char data[N];
+};
+
+// Allocated in the current soalloc_region, if any
+template <std::size_t N>
+struct Regional : public soalloc_regional<Regional<N>>
+{
+	unsigned char data[N];
+};
 
-safe-thread (mutex):
-WorkingSetSize: 27561984
-287 msec.
-*/
+// The object of the original tests: double, int and char
+const std::size_t FOO_SIZE = 16;
 
-/* test2
-standard:
-11570 msec.
-new calls: 50008182
-delete calls: 49991818
+// Filled by main and destroyed after it returns, after anything soalloc
+// creates on first use: freeing its nodes must still find their heaps
+std::map<int, int, std::less<int>, soalloc_allocator<std::pair<const int, int>>>
+	staticMap;
 
-soalloc
-29618 msec.
-new calls: 50008182
-delete calls: 49991818
-*/
+////////////////////////////////////////////////////////////////////////////////
+// Latency samples, every 32nd operation is timed on its own
+////////////////////////////////////////////////////////////////////////////////
 
-/*#pragma pack(push,1)*/
-struct foo: public soalloc<foo>
+class Latency
 {
-	double x;
-	int y;
-	char z;
+public:
+	template <typename F>
+	void Measure(F&& f)
+	{
+		if ((++tick_ & 31) != 0)
+		{
+			f();
+			return;
+		}
+		auto start = std::chrono::steady_clock::now();
+		f();
+		auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - start).count();
+		samples_.push_back(static_cast<std::uint32_t>(ns));
+	}
+
+	void Merge(const Latency& rhs)
+	{
+		samples_.insert(samples_.end(), rhs.samples_.begin(), rhs.samples_.end());
+	}
 
-	foo(): x(.0), y(0), z(0)
+	double Percentile(double p)
 	{
-//		throw 0;
+		if (samples_.empty()) return 0;
+		std::size_t k = static_cast<std::size_t>(p * (samples_.size() - 1));
+		std::nth_element(samples_.begin(), samples_.begin() + k, samples_.end());
+		return samples_[k];
 	}
+
+private:
+	std::vector<std::uint32_t> samples_;
+	unsigned tick_ = 0;
 };
-/*#pragma pack(pop)*/
 
-void testCycle()
+// Small deterministic generator, rand() differs between platforms
+class Random
 {
-	using namespace std;
-	foo* x[1000000] = { 0 };
-	//	cout << "sizeof(foo):\t" << sizeof(foo) << endl;
-	Stopwatch sw;
-	for (size_t i = 0, n = sizeof(x) / sizeof(foo*); i < n; ++i)
+public:
+	explicit Random(std::uint64_t seed) : state_(seed * 2862933555777941757ULL + 1) {}
+
+	std::uint32_t operator()()
 	{
-		x[i] = new foo(); // throwing call
-/*		try
+		state_ = state_ * 6364136223846793005ULL + 1442695040888963407ULL;
+		return static_cast<std::uint32_t>(state_ >> 33);
+	}
+
+private:
+	std::uint64_t state_;
+};
+
+struct Options
+{
+	double scale = 1.0;
+	unsigned threads = 0;
+	std::string only;
+	std::string json;
+	bool stats = false;
+	bool trim = false;
+};
+
+struct Result
+{
+	char workload[32];
+	char allocator[16];
+	unsigned threads;
+	std::uint64_t ops;
+	double seconds;
+	double p50;
+	double p99;
+	long peakRss;
+	long finalRss;
+};
+
+std::uint64_t Scaled(const Options& options, double ops)
+{
+	std::uint64_t n = static_cast<std::uint64_t>(ops * options.scale);
+	return n ? n : 1;
+}
+
+unsigned ThreadCount(const Options& options)
+{
+	const unsigned maxthreads = 32;
+	unsigned n = options.threads ? options.threads : std::thread::hardware_concurrency();
+	if (n == 0) n = 1;
+	return n < maxthreads ? n : maxthreads;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Workloads
+// Every workload returns the number of allocations and deallocations done
+////////////////////////////////////////////////////////////////////////////////
+
+// testCycle: allocate a million objects, then delete them all
+template <template <std::size_t> class Obj>
+std::uint64_t testCycle(const Options& options, Latency& latency)
+{
+	typedef Obj<FOO_SIZE> T;
+	std::vector<T*> x(Scaled(options, 1000000));
+	for (auto& p: x)
+		latency.Measure([&] { p = new T(); });
+	for (auto& p: x)
+		latency.Measure([&] { delete p; });
+	return 2 * x.size();
+}
+
+// testCycle in batches of 64 objects, newBatch/deleteBatch for soalloc
+// Latency is per batch
+template <std::size_t N>
+void newBatch(std::size_t n, Pooled<N>** out)
+{
+	Pooled<N>::newBatch(n, out);
+}
+
+template <std::size_t N>
+void newBatch(std::size_t n, Plain<N>** out)
+{
+	for (std::size_t i = 0; i < n; ++i)
+		out[i] = new Plain<N>();
+}
+
+template <std::size_t N>
+void deleteBatch(Pooled<N>** objects, std::size_t n)
+{
+	Pooled<N>::deleteBatch(objects, n);
+}
+
+template <std::size_t N>
+void deleteBatch(Plain<N>** objects, std::size_t n)
+{
+	for (std::size_t i = 0; i < n; ++i)
+		delete objects[i];
+}
+
+template <template <std::size_t> class Obj>
+std::uint64_t testBatchCycle(const Options& options, Latency& latency)
+{
+	typedef Obj<FOO_SIZE> T;
+	const std::size_t batch = 64;
+	std::vector<T*> x((Scaled(options, 1000000) + batch - 1) / batch * batch);
+	for (std::size_t i = 0; i < x.size(); i += batch)
+		latency.Measure([&] { newBatch(batch, &x[i]); });
+	for (std::size_t i = 0; i < x.size(); i += batch)
+		latency.Measure([&] { deleteBatch(&x[i], batch); });
+	return 2 * x.size();
+}
+
+// testSingleThread: random new/delete over 32768 slots
+template <typename T>
+std::uint64_t singleThread(std::uint64_t count, unsigned seed, Latency& latency)
+{
+	std::vector<T*> arr(32768, nullptr);
+	Random random(seed);
+	for (std::uint64_t i = 0; i < count; ++i)
+	{
+		T*& slot = arr[random() & 32767];
+		if (slot == nullptr)
+			latency.Measure([&] { slot = new T(); });
+		else
+			latency.Measure([&] { delete slot; slot = nullptr; });
+	}
+	for (T* p: arr)
+		delete p;
+	return count;
+}
+
+template <template <std::size_t> class Obj>
+std::uint64_t testSingleThread(const Options& options, Latency& latency)
+{
+	return singleThread<Obj<FOO_SIZE>>(Scaled(options, 20000000), 1, latency);
+}
+
+// testMultiThread: testSingleThread in every hardware thread
+template <template <std::size_t> class Obj>
+std::uint64_t testMultiThread(const Options& options, Latency& latency)
+{
+	const unsigned n = ThreadCount(options);
+	const std::uint64_t count = Scaled(options, 20000000) / n;
+	std::vector<Latency> latencies(n);
+	std::vector<std::thread> t;
+	for (unsigned i = 0; i < n; ++i)
+		t.emplace_back([&, i] { singleThread<Obj<FOO_SIZE>>(count, i + 1, latencies[i]); });
+	for (auto& i: t)
+		i.join();
+	for (auto& l: latencies)
+		latency.Merge(l);
+	return count * n;
+}
+
+// Random new/delete of objects from 8 to 256 bytes
+template <template <std::size_t> class Obj>
+struct MixedSlot
+{
+	void* p = nullptr;
+	unsigned kind = 0;
+
+	void Allocate(unsigned k)
+	{
+		kind = k;
+		switch (kind)
 		{
-			x[i] = new (std::nothrow) foo(); // nothrow call
+		case 0: p = new Obj<8>(); break;
+		case 1: p = new Obj<16>(); break;
+		case 2: p = new Obj<24>(); break;
+		case 3: p = new Obj<40>(); break;
+		case 4: p = new Obj<64>(); break;
+		case 5: p = new Obj<100>(); break;
+		case 6: p = new Obj<128>(); break;
+		default: p = new Obj<256>(); break;
 		}
-		catch (...)
-		{
-			std::cout << "caught the exception" << std::endl;
-		}*/
-		//		cout << x[i] << endl;
 	}
-	/*	foo* y = nullptr;
-		try
+
+	void Free()
+	{
+		switch (kind)
 		{
-			y = new foo[10]();
+		case 0: delete static_cast<Obj<8>*>(p); break;
+		case 1: delete static_cast<Obj<16>*>(p); break;
+		case 2: delete static_cast<Obj<24>*>(p); break;
+		case 3: delete static_cast<Obj<40>*>(p); break;
+		case 4: delete static_cast<Obj<64>*>(p); break;
+		case 5: delete static_cast<Obj<100>*>(p); break;
+		case 6: delete static_cast<Obj<128>*>(p); break;
+		default: delete static_cast<Obj<256>*>(p); break;
 		}
-		catch(...)
-		{
-			std::cout << "caught the exception" << std::endl;
-		}*/
+		p = nullptr;
+	}
+};
 
-	PROCESS_MEMORY_COUNTERS pmc;
-	if (::GetProcessMemoryInfo(::GetCurrentProcess(), &pmc, sizeof(pmc)))
-		cout << "WorkingSetSize:\t" << pmc.WorkingSetSize << endl;
+template <template <std::size_t> class Obj>
+std::uint64_t testMixedSizes(const Options& options, Latency& latency)
+{
+	const std::uint64_t count = Scaled(options, 10000000);
+	std::vector<MixedSlot<Obj>> arr(65536);
+	Random random(7);
+	for (std::uint64_t i = 0; i < count; ++i)
+	{
+		std::uint32_t r = random();
+		MixedSlot<Obj>& slot = arr[r & 65535];
+		if (slot.p == nullptr)
+			latency.Measure([&] { slot.Allocate((r >> 16) & 7); });
+		else
+			latency.Measure([&] { slot.Free(); });
+	}
+	for (auto& slot: arr)
+		if (slot.p) slot.Free();
+	return count;
+}
 
-	//	delete[] y;
+// Random new[]/delete[] of 1 to 8 element arrays, like fixed-fanout nodes
+template <template <std::size_t> class Obj>
+std::uint64_t testSmallArrays(const Options& options, Latency& latency)
+{
+	typedef Obj<FOO_SIZE> T;
+	const std::uint64_t count = Scaled(options, 10000000);
+	std::vector<T*> arr(32768, nullptr);
+	Random random(5);
+	for (std::uint64_t i = 0; i < count; ++i)
+	{
+		std::uint32_t r = random();
+		T*& slot = arr[r & 32767];
+		if (slot == nullptr)
+			latency.Measure([&] { slot = new T[1 + (r >> 15) % 8](); });
+		else
+			latency.Measure([&] { delete[] slot; slot = nullptr; });
+	}
+	for (T* p: arr)
+		delete[] p;
+	return count;
+}
 
-	for (size_t i = 0, n = sizeof(x) / sizeof(foo*); i < n; ++i)
-		delete x[i];
+// Producers allocate, one consumer deletes: every delete is cross-thread
+template <template <std::size_t> class Obj>
+std::uint64_t testProducerConsumer(const Options& options, Latency& latency)
+{
+	typedef Obj<FOO_SIZE> T;
+	const unsigned producers = ThreadCount(options) > 1 ? ThreadCount(options) - 1 : 1;
+	const std::uint64_t count = Scaled(options, 4000000) / producers;
+	const std::size_t batchSize = 256;
+
+	std::mutex mutex;
+	std::condition_variable ready;
+	std::vector<std::vector<T*>> queue;
+	unsigned running = producers;
 
-	std::cout << std::endl << sw.Elapsed().count() << " msec." << std::endl;
+	std::vector<Latency> latencies(producers);
+	std::vector<std::thread> t;
+	for (unsigned i = 0; i < producers; ++i)
+	{
+		t.emplace_back([&, i]
+		{
+			std::vector<T*> batch;
+			for (std::uint64_t k = 0; k < count; ++k)
+			{
+				latencies[i].Measure([&] { batch.push_back(new T()); });
+				if (batch.size() == batchSize || k + 1 == count)
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					queue.push_back(std::move(batch));
+					batch.clear();
+					ready.notify_one();
+				}
+			}
+			std::lock_guard<std::mutex> lock(mutex);
+			--running;
+			ready.notify_one();
+		});
+	}
 
-	cout << "Finish!" << endl;
+	for (;;)
+	{
+		std::vector<std::vector<T*>> work;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			ready.wait(lock, [&] { return !queue.empty() || running == 0; });
+			if (queue.empty()) break;
+			work.swap(queue);
+		}
+		for (auto& batch: work)
+			for (T* p: batch)
+				latency.Measure([&] { delete p; });
+	}
+	for (auto& i: t)
+		i.join();
+	for (auto& l: latencies)
+		latency.Merge(l);
+	return 2 * count * producers;
 }
 
-template <typename T>
-void testSingleThread()
-{
-	using namespace std;
-	unsigned int count = 100000000; // (std::numeric_limits<unsigned int>::max)();
-	unsigned int newCalls = 0;
-	unsigned int delCalls = 0;
-	T* arr[RAND_MAX + 1] = { nullptr };
-	cout << "Second test!" << endl;
-	Stopwatch sw;
+// Allocate a large burst, then free all of it, again and again
+template <template <std::size_t> class Obj>
+std::uint64_t testBurstDrain(const Options& options, Latency& latency)
+{
+	typedef Obj<FOO_SIZE> T;
+	const std::size_t burst = 500000;
+	const std::uint64_t rounds = Scaled(options, 20);
+	std::vector<T*> x(burst);
+	Random random(11);
+	for (std::uint64_t r = 0; r < rounds; ++r)
+	{
+		for (auto& p: x)
+			latency.Measure([&] { p = new T(); });
+		// drain in a shuffled order
+		for (std::size_t i = burst - 1; i > 0; --i)
+			std::swap(x[i], x[random() % (i + 1)]);
+		for (auto& p: x)
+			latency.Measure([&] { delete p; });
+	}
+	return 2 * burst * rounds;
+}
+
+// A large long-lived population with short-lived objects churning around it
+template <template <std::size_t> class Obj>
+std::uint64_t testLongLivedChurn(const Options& options, Latency& latency)
+{
+	typedef Obj<FOO_SIZE> T;
+	typedef Obj<48> U;
+	std::vector<T*> longLived(1000000);
+	for (auto& p: longLived)
+		latency.Measure([&] { p = new T(); });
 
-	while (count--)
+	const std::uint64_t count = Scaled(options, 10000000);
+	std::vector<U*> arr(4096, nullptr);
+	Random random(13);
+	for (std::uint64_t i = 0; i < count; ++i)
 	{
-		int iRand = rand();
-		if (arr[iRand] == nullptr)
+		std::uint32_t r = random();
+		U*& slot = arr[r & 4095];
+		if (slot == nullptr)
+			latency.Measure([&] { slot = new U(); });
+		else
+			latency.Measure([&] { delete slot; slot = nullptr; });
+		// now and then replace a long-lived object
+		if ((r >> 12 & 63) == 0)
 		{
-			arr[iRand] = new T();
-			newCalls++;
+			T*& old = longLived[(r >> 18) % longLived.size()];
+			delete old;
+			old = new T();
 		}
-		else
+	}
+	for (U* p: arr)
+		delete p;
+	for (T* p: longLived)
+		delete p;
+	return count + 2 * longLived.size();
+}
+
+// A request: nothing to do for operator new, a region for soalloc
+template <template <std::size_t> class Obj>
+struct RequestScope
+{
+	RequestScope() {}
+};
+
+template <>
+struct RequestScope<Regional>
+{
+	soalloc_region region;
+};
+
+// Requests that build a few thousand small objects and delete them all when
+// they finish
+template <template <std::size_t> class Obj>
+std::uint64_t testRequests(const Options& options, Latency& latency)
+{
+	typedef Obj<FOO_SIZE> T;
+	typedef Obj<48> U;
+	// Aligned beyond a chunk's blocks, comes from the heap even in a region
+	struct alignas(128) W : Obj<FOO_SIZE>
+	{
+	};
+	const std::size_t perRequest = 2000;
+	const std::uint64_t requests = Scaled(options, 2000);
+	std::vector<T*> x(perRequest);
+	std::vector<U*> y(perRequest);
+	for (std::uint64_t r = 0; r < requests; ++r)
+	{
+		RequestScope<Obj> scope;
+		W* w = new W();
+		if (reinterpret_cast<std::uintptr_t>(w) % alignof(W) != 0)
+		{
+			std::cerr << "request_region: misaligned object" << std::endl;
+			std::abort();
+		}
+		for (std::size_t i = 0; i < perRequest; ++i)
 		{
-			delete arr[iRand];
-			arr[iRand] = nullptr;
-			delCalls++;
+			latency.Measure([&] { x[i] = new T(); });
+			latency.Measure([&] { y[i] = new U(); });
+		}
+		delete w;
+		for (std::size_t i = 0; i < perRequest; ++i)
+		{
+			latency.Measure([&] { delete x[i]; });
+			latency.Measure([&] { delete y[i]; });
 		}
-		//		if (count%100000==0) std::cout << "+";
 	}
-	std::cout << std::endl << sw.Elapsed().count() << " msec." << std::endl;
-	std::cout << "new calls: " << newCalls << std::endl;
-	std::cout << "delete calls: " << delCalls << std::endl;
+	return 4 * perRequest * requests;
+}
 
-	for (int i = 0; i < (RAND_MAX + 1); ++i)
+// Node based containers with the same keys, nodes from the given allocator
+// Inserts a missing random key or erases a present one
+template <typename Container, typename Insert>
+std::uint64_t containerChurn(Container& c, const Options& options,
+	Latency& latency, Insert insert)
+{
+	const std::uint64_t count = Scaled(options, 5000000);
+	Random random(17);
+	for (std::uint64_t i = 0; i < count; ++i)
 	{
-		//if (arr[i])  <- not necessary
-		delete arr[i];
+		const std::uint32_t key = random() & 65535;
+		auto it = c.find(key);
+		if (it == c.end())
+			latency.Measure([&] { insert(c, key); });
+		else
+			latency.Measure([&] { c.erase(it); });
 	}
+	return count;
+}
 
-	std::cout << std::endl;
+template <template <typename> class Alloc>
+std::uint64_t testMap(const Options& options, Latency& latency)
+{
+	std::map<std::uint32_t, std::uint32_t, std::less<std::uint32_t>,
+		Alloc<std::pair<const std::uint32_t, std::uint32_t>>> c;
+	return containerChurn(c, options, latency,
+		[](decltype(c)& c, std::uint32_t key) { c.emplace(key, key); });
 }
 
-template <typename T>
-void testMultiThread()
+template <template <typename> class Alloc>
+std::uint64_t testSet(const Options& options, Latency& latency)
+{
+	std::set<std::uint32_t, std::less<std::uint32_t>, Alloc<std::uint32_t>> c;
+	return containerChurn(c, options, latency,
+		[](decltype(c)& c, std::uint32_t key) { c.insert(key); });
+}
+
+template <template <typename> class Alloc>
+std::uint64_t testUnorderedMap(const Options& options, Latency& latency)
+{
+	std::unordered_map<std::uint32_t, std::uint32_t, std::hash<std::uint32_t>,
+		std::equal_to<std::uint32_t>,
+		Alloc<std::pair<const std::uint32_t, std::uint32_t>>> c;
+	return containerChurn(c, options, latency,
+		[](decltype(c)& c, std::uint32_t key) { c.emplace(key, key); });
+}
+
+// A queue kept around 32768 elements
+template <template <typename> class Alloc>
+std::uint64_t testList(const Options& options, Latency& latency)
+{
+	std::list<std::uint32_t, Alloc<std::uint32_t>> c;
+	const std::uint64_t count = Scaled(options, 10000000);
+	Random random(19);
+	for (std::uint64_t i = 0; i < count; ++i)
+	{
+		std::uint32_t r = random();
+		if (!c.empty() && (r & 65535) < c.size())
+			latency.Measure([&] { c.pop_front(); });
+		else
+			latency.Measure([&] { c.push_back(r); });
+	}
+	return count;
+}
+
+#ifdef SOALLOC_HAS_MEMORY_RESOURCE
+// std::pmr::map over soalloc_memory_resource or new_delete_resource
+template <bool pooled>
+std::uint64_t testPmrMap(const Options& options, Latency& latency)
+{
+	std::pmr::map<std::uint32_t, std::uint32_t> c(pooled ?
+		static_cast<std::pmr::memory_resource*>(soalloc_memory_resource::Get()) :
+		std::pmr::new_delete_resource());
+	return containerChurn(c, options, latency,
+		[](decltype(c)& c, std::uint32_t key) { c.emplace(key, key); });
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Runner
+////////////////////////////////////////////////////////////////////////////////
+
+typedef std::uint64_t (*Workload)(const Options&, Latency&);
+
+struct Benchmark
 {
-	const unsigned int maxthreads = 32;
-	unsigned int n = std::thread::hardware_concurrency();
-	std::cout << n << " concurrent threads are supported.\n";
-	std::thread t[maxthreads];
-	for (unsigned int i = 0; i < n && i < maxthreads; ++i)
-		t[i] = std::thread([]() mutable { testSingleThread<T>(); });
-	for (unsigned int i = 0; i < n && i < maxthreads; ++i)
-		t[i].join();
-	std::cout << "Ready!" << "[" << std::this_thread::get_id() << "]" << std::endl;
+	const char* name;
+	Workload pooled;
+	Workload plain;
+	bool multiThreaded;
+};
+
+Result Run(const Options& options, const char* name, const char* allocator,
+	Workload workload, unsigned threads)
+{
+	Result result;
+	std::memset(&result, 0, sizeof(result));
+	std::snprintf(result.workload, sizeof(result.workload), "%s", name);
+	std::snprintf(result.allocator, sizeof(result.allocator), "%s", allocator);
+	result.threads = threads;
+
+	Latency latency;
+	Stopwatch sw;
+	result.ops = workload(options, latency);
+	result.seconds = sw.Elapsed().count();
+	result.p50 = latency.Percentile(0.50);
+	result.p99 = latency.Percentile(0.99);
 
+#ifdef SOALLOC_STATS
+	if (options.stats && std::strcmp(allocator, "soalloc") == 0)
+	{
+		AllocatorStats stats;
+		ThreadHeap::CollectStats(stats);
+		std::cout << name << ":\n";
+		stats.Dump(std::cout);
+		std::cout.flush();
+	}
+#endif
+
+	if (options.trim)
+	{
+		if (std::strcmp(allocator, "soalloc") == 0)
+			ThreadHeap::Trim();
+#if defined(__GLIBC__)
+		::malloc_trim(0);
+#endif
+	}
+
+	MemoryUsage usage = GetMemoryUsage();
+	result.peakRss = usage.peakRss;
+	result.finalRss = usage.rss;
+	return result;
 }
 
-int main()
+// Runs every case in a child process where possible, so that peak RSS is
+// not shared between allocators and workloads
+Result RunIsolated(const Options& options, const char* name, const char* allocator,
+	Workload workload, unsigned threads)
 {
-//	testCycle();
-//	testSingleThread<foo>();
-	testMultiThread<foo>();
+#if defined(__unix__) || defined(__APPLE__)
+	int fds[2];
+	if (::pipe(fds) == 0)
+	{
+		std::cout.flush();
+		pid_t pid = ::fork();
+		if (pid == 0)
+		{
+			::close(fds[0]);
+			Result result = Run(options, name, allocator, workload, threads);
+#ifdef SOALLOC_TRACE
+			// _exit skips the thread_local destructors that write the trace
+			TraceRecorder::Flush();
+#endif
+			ssize_t written = ::write(fds[1], &result, sizeof(result));
+			::_exit(written == sizeof(result) ? 0 : 1);
+		}
+		::close(fds[1]);
+		Result result;
+		ssize_t got = pid > 0 ? ::read(fds[0], &result, sizeof(result)) : -1;
+		::close(fds[0]);
+		if (pid > 0)
+		{
+			int status;
+			::waitpid(pid, &status, 0);
+		}
+		if (got == sizeof(result)) return result;
+	}
+#endif
+	return Run(options, name, allocator, workload, threads);
+}
+
+void WriteJson(std::ostream& out, const std::vector<Result>& results)
+{
+	out << "{\n  \"revision\": \"" << SOALLOC_REVISION << "\",\n"
+		<< "  \"results\": [\n";
+	for (std::size_t i = 0; i < results.size(); ++i)
+	{
+		const Result& r = results[i];
+		out << "    {\"workload\": \"" << r.workload << "\""
+			<< ", \"allocator\": \"" << r.allocator << "\""
+			<< ", \"threads\": " << r.threads
+			<< ", \"ops\": " << r.ops
+			<< ", \"seconds\": " << r.seconds
+			<< ", \"ops_per_sec\": " << (r.seconds > 0 ? r.ops / r.seconds : 0)
+			<< ", \"p50_ns\": " << r.p50
+			<< ", \"p99_ns\": " << r.p99
+			<< ", \"peak_rss_kb\": " << r.peakRss
+			<< ", \"final_rss_kb\": " << r.finalRss
+			<< "}" << (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	out << "  ]\n}\n";
+}
+
+int main(int argc, char* argv[])
+{
+	for (int i = 0; i < 1000; ++i)
+		staticMap[i] = i;
+
+	Options options;
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (arg == "--json" && i + 1 < argc) options.json = argv[++i];
+		else if (arg == "--scale" && i + 1 < argc) options.scale = std::atof(argv[++i]);
+		else if (arg == "--threads" && i + 1 < argc) options.threads = std::atoi(argv[++i]);
+		else if (arg == "--only" && i + 1 < argc) options.only = argv[++i];
+		else if (arg == "--stats") options.stats = true;
+		else if (arg == "--trim") options.trim = true;
+		else
+		{
+			std::cerr << "usage: " << argv[0]
+				<< " [--json FILE] [--scale X] [--threads N] [--only NAME] [--stats]"
+				" [--trim]" << std::endl;
+			return 1;
+		}
+	}
+
+	const Benchmark benchmarks[] =
+	{
+		{ "cycle", testCycle<Pooled>, testCycle<Plain>, false },
+		{ "batch_cycle", testBatchCycle<Pooled>, testBatchCycle<Plain>, false },
+		{ "single_thread", testSingleThread<Pooled>, testSingleThread<Plain>, false },
+		{ "multi_thread", testMultiThread<Pooled>, testMultiThread<Plain>, true },
+		{ "mixed_sizes", testMixedSizes<Pooled>, testMixedSizes<Plain>, false },
+		{ "small_arrays", testSmallArrays<Pooled>, testSmallArrays<Plain>, false },
+		{ "producer_consumer", testProducerConsumer<Pooled>, testProducerConsumer<Plain>, true },
+		{ "burst_drain", testBurstDrain<Pooled>, testBurstDrain<Plain>, false },
+		{ "long_lived_churn", testLongLivedChurn<Pooled>, testLongLivedChurn<Plain>, false },
+		{ "request_region", testRequests<Regional>, testRequests<Plain>, false },
+		{ "std_map", testMap<soalloc_allocator>, testMap<std::allocator>, false },
+		{ "std_set", testSet<soalloc_allocator>, testSet<std::allocator>, false },
+		{ "std_unordered_map", testUnorderedMap<soalloc_allocator>,
+			testUnorderedMap<std::allocator>, false },
+		{ "std_list", testList<soalloc_allocator>, testList<std::allocator>, false },
+#ifdef SOALLOC_HAS_MEMORY_RESOURCE
+		{ "pmr_map", testPmrMap<true>, testPmrMap<false>, false },
+#endif
+	};
+
+	std::vector<Result> results;
+	std::cout << std::left << std::setw(20) << "workload" << std::setw(10) << "allocator"
+		<< std::right << std::setw(14) << "Mops/s" << std::setw(10) << "p50 ns"
+		<< std::setw(10) << "p99 ns" << std::setw(12) << "peak kB"
+		<< std::setw(12) << "final kB" << std::endl;
+	for (const Benchmark& b: benchmarks)
+	{
+		if (!options.only.empty() && options.only != b.name) continue;
+		const unsigned threads = b.multiThreaded ? ThreadCount(options) : 1;
+		results.push_back(RunIsolated(options, b.name, "soalloc", b.pooled, threads));
+		results.push_back(RunIsolated(options, b.name, "system", b.plain, threads));
+		for (auto i = results.end() - 2; i != results.end(); ++i)
+		{
+			std::cout << std::left << std::setw(20) << i->workload << std::setw(10)
+				<< i->allocator << std::right << std::fixed << std::setprecision(2)
+				<< std::setw(14) << (i->seconds > 0 ? i->ops / i->seconds / 1e6 : 0)
+				<< std::setprecision(0) << std::setw(10) << i->p50 << std::setw(10)
+				<< i->p99 << std::setw(12) << i->peakRss << std::setw(12)
+				<< i->finalRss << std::endl;
+		}
+	}
+
+	if (!options.json.empty())
+	{
+		std::ofstream out(options.json);
+		if (!out)
+		{
+			std::cerr << "cannot write " << options.json << std::endl;
+			return 1;
+		}
+		WriteJson(out, results);
+	}
 	return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,366 @@
+// This is an open source non-commercial project. Dear PVS-Studio, please check it.
+
+// PVS-Studio Static Code Analyzer for C, C++ and C#: http://www.viva64.com
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//	soalloc_replay
+//	Replays an allocation trace recorded with SOALLOC_TRACE against soalloc
+//	and against the global operator new, and reports the time taken, peak
+//	and final RSS and fragmentation
+//
+//	usage: soalloc_replay [--only soalloc|system] TRACE
+//
+//	Every recorded thread is replayed on a thread of its own, in its own
+//	order; a thread freeing a block of another waits until that block has
+//	been allocated. Blocks are written in full, as their objects would be.
+//	Fragmentation is the part of the RSS grown at the peak that live blocks
+//	do not explain
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include "soalloc.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Memory usage of the process in kB, 0 where it cannot be measured
+////////////////////////////////////////////////////////////////////////////////
+
+struct MemoryUsage
+{
+	long peakRss;
+	long rss;
+};
+
+MemoryUsage GetMemoryUsage()
+{
+	MemoryUsage usage = { 0, 0 };
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (::GetProcessMemoryInfo(::GetCurrentProcess(), &pmc, sizeof(pmc)))
+	{
+		usage.peakRss = static_cast<long>(pmc.PeakWorkingSetSize / 1024);
+		usage.rss = static_cast<long>(pmc.WorkingSetSize / 1024);
+	}
+#else
+	if (FILE* f = std::fopen("/proc/self/status", "r"))
+	{
+		char line[256];
+		while (std::fgets(line, sizeof(line), f))
+		{
+			if (!std::strncmp(line, "VmHWM:", 6)) usage.peakRss = std::atol(line + 6);
+			else if (!std::strncmp(line, "VmRSS:", 6)) usage.rss = std::atol(line + 6);
+		}
+		std::fclose(f);
+	}
+#endif
+	return usage;
+}
+
+// Starts the peak RSS over from the current RSS where the system allows it
+void ResetPeakRss()
+{
+#if defined(__linux__)
+	if (FILE* f = std::fopen("/proc/self/clear_refs", "w"))
+	{
+		std::fputs("5", f);
+		std::fclose(f);
+	}
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The trace, prepared for replay
+// Every allocation gets a slot, its deallocation refers to the same slot
+////////////////////////////////////////////////////////////////////////////////
+
+struct Operation
+{
+	std::uint32_t slot;
+	bool allocate;
+};
+
+struct Slot
+{
+	std::uint32_t size;
+	std::uint32_t alignment;
+};
+
+struct Replay
+{
+	std::vector<std::vector<Operation>> threads;
+	std::vector<Slot> slots;
+	std::uint64_t operations = 0;
+	// Frees of blocks allocated before the trace or in a soalloc_region
+	std::uint64_t unmatched = 0;
+	std::uint64_t peakLiveBytes = 0;
+};
+
+bool Load(const char* path, Replay& replay)
+{
+	std::ifstream in(path, std::ios::binary);
+	TraceHeader header;
+	if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+		!std::equal(TRACE_MAGIC, TRACE_MAGIC + sizeof(header.magic), header.magic) ||
+		header.version != TRACE_VERSION || header.eventSize != sizeof(TraceEvent))
+	{
+		std::cerr << path << ": not a soalloc trace of this version\n";
+		return false;
+	}
+
+	std::vector<TraceEvent> events;
+	TraceEvent event;
+	while (in.read(reinterpret_cast<char*>(&event), sizeof(event)))
+		events.push_back(event);
+
+	// Runs of different threads interleave in the file
+	std::stable_sort(events.begin(), events.end(),
+		[](const TraceEvent& a, const TraceEvent& b) { return a.time < b.time; });
+
+	std::unordered_map<std::uint64_t, std::uint32_t> live;
+	std::uint64_t liveBytes = 0;
+	for (const TraceEvent& e: events)
+	{
+		if (e.thread >= replay.threads.size()) replay.threads.resize(e.thread + 1);
+		if (e.op == TraceOp::Allocate)
+		{
+			const std::uint32_t slot = static_cast<std::uint32_t>(replay.slots.size());
+			replay.slots.push_back({ e.size, std::uint32_t(1) << e.alignmentShift });
+			// A block reused without a recorded free stays allocated
+			live[e.object] = slot;
+			replay.threads[e.thread].push_back({ slot, true });
+			liveBytes += e.size;
+			replay.peakLiveBytes = std::max(replay.peakLiveBytes, liveBytes);
+		}
+		else
+		{
+			auto i = live.find(e.object);
+			if (i == live.end())
+			{
+				++replay.unmatched;
+				continue;
+			}
+			replay.threads[e.thread].push_back({ i->second, false });
+			liveBytes -= replay.slots[i->second].size;
+			live.erase(i);
+		}
+		++replay.operations;
+	}
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Allocators
+////////////////////////////////////////////////////////////////////////////////
+
+struct Soalloc
+{
+	static void* Allocate(const Slot& slot)
+	{
+		return ThreadHeap::Get()->Allocate(slot.size, slot.alignment);
+	}
+	static void Deallocate(void* p, const Slot& slot)
+	{
+		ThreadHeap::Get()->Deallocate(p, slot.size, slot.alignment);
+	}
+};
+
+struct System
+{
+	static void* Allocate(const Slot& slot)
+	{
+		if (slot.alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+			return ::operator new(slot.size, std::align_val_t(slot.alignment));
+		return ::operator new(slot.size);
+	}
+	static void Deallocate(void* p, const Slot& slot)
+	{
+		if (slot.alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+			return ::operator delete(p, std::align_val_t(slot.alignment));
+		::operator delete(p);
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Runner
+////////////////////////////////////////////////////////////////////////////////
+
+struct Result
+{
+	double seconds;
+	long peakKb;		// RSS grown at the peak
+	long finalKb;		// RSS grown once every block is freed
+	double fragmentation;
+};
+
+template <typename Allocator>
+void ReplayThread(const Replay& replay, const std::vector<Operation>& operations,
+	std::vector<std::atomic<void*>>& blocks)
+{
+	for (const Operation& op: operations)
+	{
+		const Slot& slot = replay.slots[op.slot];
+		if (op.allocate)
+		{
+			void* p = Allocator::Allocate(slot);
+			std::memset(p, 0, slot.size);
+			blocks[op.slot].store(p, std::memory_order_release);
+		}
+		else
+		{
+			void* p;
+			while ((p = blocks[op.slot].load(std::memory_order_acquire)) == nullptr)
+				std::this_thread::yield();
+			blocks[op.slot].store(nullptr, std::memory_order_relaxed);
+			Allocator::Deallocate(p, slot);
+		}
+	}
+}
+
+template <typename Allocator>
+Result Run(const Replay& replay)
+{
+	std::vector<std::atomic<void*>> blocks(replay.slots.size());
+	for (auto& block: blocks)
+		block.store(nullptr, std::memory_order_relaxed);
+
+	ResetPeakRss();
+	const MemoryUsage before = GetMemoryUsage();
+	const std::chrono::steady_clock::time_point start =
+		std::chrono::steady_clock::now();
+
+	std::vector<std::thread> threads;
+	for (const std::vector<Operation>& operations: replay.threads)
+	{
+		if (operations.empty()) continue;
+		threads.emplace_back([&replay, &operations, &blocks] {
+			ReplayThread<Allocator>(replay, operations, blocks);
+		});
+	}
+	for (std::thread& t: threads)
+		t.join();
+
+	Result result;
+	result.seconds = std::chrono::duration<double>(
+		std::chrono::steady_clock::now() - start).count();
+	const MemoryUsage peak = GetMemoryUsage();
+
+	// Blocks never freed in the trace
+	for (std::size_t i = 0; i < blocks.size(); ++i)
+	{
+		if (void* p = blocks[i].load(std::memory_order_relaxed))
+			Allocator::Deallocate(p, replay.slots[i]);
+	}
+	const MemoryUsage after = GetMemoryUsage();
+
+	result.peakKb = std::max(peak.peakRss, peak.rss) - before.rss;
+	result.finalKb = after.rss - before.rss;
+	const double grown = static_cast<double>(result.peakKb) * 1024;
+	result.fragmentation = grown > replay.peakLiveBytes ?
+		1 - replay.peakLiveBytes / grown : 0;
+	return result;
+}
+
+// Runs in a child process where possible, so that every allocator starts
+// from the same RSS
+template <typename Allocator>
+Result RunIsolated(const Replay& replay)
+{
+#if defined(__unix__) || defined(__APPLE__)
+	int fds[2];
+	if (::pipe(fds) == 0)
+	{
+		std::cout.flush();
+		pid_t pid = ::fork();
+		if (pid == 0)
+		{
+			::close(fds[0]);
+			Result result = Run<Allocator>(replay);
+			ssize_t written = ::write(fds[1], &result, sizeof(result));
+			::_exit(written == sizeof(result) ? 0 : 1);
+		}
+		::close(fds[1]);
+		Result result;
+		ssize_t got = pid > 0 ? ::read(fds[0], &result, sizeof(result)) : -1;
+		::close(fds[0]);
+		if (pid > 0)
+		{
+			int status;
+			::waitpid(pid, &status, 0);
+		}
+		if (got == sizeof(result)) return result;
+	}
+#endif
+	return Run<Allocator>(replay);
+}
+
+void Print(const char* allocator, const Replay& replay, const Result& result)
+{
+	std::cout << std::left << std::setw(10) << allocator << std::right
+		<< std::fixed << std::setprecision(3)
+		<< std::setw(10) << result.seconds
+		<< std::setprecision(2)
+		<< std::setw(10) << replay.operations / result.seconds / 1e6
+		<< std::setw(12) << result.peakKb
+		<< std::setw(12) << result.finalKb
+		<< std::setprecision(1)
+		<< std::setw(9) << result.fragmentation * 100 << "%\n";
+}
+
+int main(int argc, char* argv[])
+{
+	std::string only;
+	const char* path = nullptr;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (!std::strcmp(argv[i], "--only") && i + 1 < argc) only = argv[++i];
+		else if (argv[i][0] != '-' && path == nullptr) path = argv[i];
+		else
+		{
+			std::cerr << "usage: soalloc_replay [--only soalloc|system] TRACE\n";
+			return 2;
+		}
+	}
+	if (path == nullptr)
+	{
+		std::cerr << "usage: soalloc_replay [--only soalloc|system] TRACE\n";
+		return 2;
+	}
+
+	Replay replay;
+	if (!Load(path, replay)) return 1;
+
+	std::cout << replay.operations << " operations on " << replay.threads.size()
+		<< " threads, " << replay.unmatched << " unmatched frees, peak live "
+		<< replay.peakLiveBytes / 1024 << " kB\n";
+	std::cout << std::left << std::setw(10) << "allocator" << std::right
+		<< std::setw(10) << "seconds" << std::setw(10) << "Mops/s"
+		<< std::setw(12) << "peak kB" << std::setw(12) << "final kB"
+		<< std::setw(10) << "frag" << '\n';
+	if (only.empty() || only == "soalloc")
+		Print("soalloc", replay, RunIsolated<Soalloc>(replay));
+	if (only.empty() || only == "system")
+		Print("system", replay, RunIsolated<System>(replay));
+	return 0;
+}
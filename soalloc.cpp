@@ -3,48 +3,468 @@
 // PVS-Studio Static Code Analyzer for C, C++ and C#: http://www.viva64.com
 
 #include <cassert>
+#include <climits>
+#include <cstddef>
+#include <limits>
 #include <algorithm>
 #include "soalloc.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#endif
+
+#ifdef SOALLOC_STATS
+#include <ostream>
+#include <iomanip>
+#endif
+
+#ifdef SOALLOC_TRACE
+#include <cstdio>
+#endif
+
+#ifdef SOALLOC_PER_CPU
+#if defined(__linux__) && defined(__GNUC__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define SOALLOC_HAS_RSEQ
+#endif
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+#endif
+
+std::atomic<PageMap::Mid*> PageMap::root_[std::size_t(1) << PageMap::ROOT_BITS];
+std::mutex PageMap::mutex_;
+
+////////////////////////////////////////////////////////////////////////////////
+// PageMap::Find
+// Returns the value assigned to the page containing 'p', or nullptr
+////////////////////////////////////////////////////////////////////////////////
+
+void* PageMap::Find(const void* p) noexcept
+{
+	const std::uintptr_t page =
+		reinterpret_cast<std::uintptr_t>(p) >> SOALLOC_PAGE_SHIFT;
+	if (page >> PAGE_BITS) return nullptr;
+
+	Mid* mid = root_[page >> (MID_BITS + LEAF_BITS)].load(std::memory_order_acquire);
+	if (!mid) return nullptr;
+	Leaf* leaf = mid->leaves[(page >> LEAF_BITS) & ((std::size_t(1) << MID_BITS) - 1)]
+		.load(std::memory_order_acquire);
+	if (!leaf) return nullptr;
+	return leaf->pages[page & ((std::size_t(1) << LEAF_BITS) - 1)]
+		.load(std::memory_order_acquire);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// PageMap::Covers
+// Tells whether every page of [p, p + length) lies below ADDRESS_BITS, as
+//     with 5 level page tables or a high mmap hint it may not
+////////////////////////////////////////////////////////////////////////////////
+
+bool PageMap::Covers(const void* p, std::size_t length) noexcept
+{
+	const std::uintptr_t first =
+		reinterpret_cast<std::uintptr_t>(p) >> SOALLOC_PAGE_SHIFT;
+	const std::uintptr_t last = first + ((length - 1) >> SOALLOC_PAGE_SHIFT);
+	return length > 0 && last >= first && (last >> PAGE_BITS) == 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// PageMap::Assign
+// Assigns 'value' to every page of [p, p + length), p must be page aligned
+// Interior nodes are created on demand and never freed
+// Throws std::bad_alloc for pages the map does not cover
+////////////////////////////////////////////////////////////////////////////////
+
+void PageMap::Assign(const void* p, std::size_t length, void* value)
+{
+	assert((reinterpret_cast<std::uintptr_t>(p) & (SOALLOC_PAGE_SIZE - 1)) == 0);
+	if (!Covers(p, length)) throw std::bad_alloc();
+
+	const std::uintptr_t first =
+		reinterpret_cast<std::uintptr_t>(p) >> SOALLOC_PAGE_SHIFT;
+	const std::uintptr_t last = first + ((length - 1) >> SOALLOC_PAGE_SHIFT);
+
+	for (std::uintptr_t page = first; page <= last; ++page)
+	{
+		std::atomic<Mid*>& midRef = root_[page >> (MID_BITS + LEAF_BITS)];
+		Mid* mid = midRef.load(std::memory_order_acquire);
+		if (!mid)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			mid = midRef.load(std::memory_order_relaxed);
+			if (!mid)
+			{
+				mid = new Mid();
+				midRef.store(mid, std::memory_order_release);
+			}
+		}
+		std::atomic<Leaf*>& leafRef =
+			mid->leaves[(page >> LEAF_BITS) & ((std::size_t(1) << MID_BITS) - 1)];
+		Leaf* leaf = leafRef.load(std::memory_order_acquire);
+		if (!leaf)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			leaf = leafRef.load(std::memory_order_relaxed);
+			if (!leaf)
+			{
+				leaf = new Leaf();
+				leafRef.store(leaf, std::memory_order_release);
+			}
+		}
+		leaf->pages[page & ((std::size_t(1) << LEAF_BITS) - 1)]
+			.store(value, std::memory_order_release);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// PageMap::PrepareFork
+////////////////////////////////////////////////////////////////////////////////
+
+void PageMap::PrepareFork() noexcept
+{
+	mutex_.lock();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// PageMap::AfterFork
+////////////////////////////////////////////////////////////////////////////////
+
+void PageMap::AfterFork() noexcept
+{
+	mutex_.unlock();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// PageProvider::Default
+// mmap based where available, the global operator new elsewhere
+// Heaps may outlive any static object, so the instance is never destroyed
+////////////////////////////////////////////////////////////////////////////////
+
+PageProvider& PageProvider::Default()
+{
+#if defined(__unix__) || defined(__APPLE__)
+	static PageProvider* provider = new MmapPageProvider();
+#else
+	static PageProvider* provider = new NewPageProvider();
+#endif
+	return *provider;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// NewPageProvider::Allocate
+////////////////////////////////////////////////////////////////////////////////
+
+void* NewPageProvider::Allocate(std::size_t length)
+{
+	return ::operator new (length, std::align_val_t(SOALLOC_PAGE_SIZE));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// NewPageProvider::Deallocate
+////////////////////////////////////////////////////////////////////////////////
+
+void NewPageProvider::Deallocate(void* p, std::size_t) noexcept
+{
+	::operator delete (p, std::align_val_t(SOALLOC_PAGE_SIZE));
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+
+////////////////////////////////////////////////////////////////////////////////
+// MmapPageProvider::MmapPageProvider
+// Nothing is reserved until the first chunk is requested
+////////////////////////////////////////////////////////////////////////////////
+
+MmapPageProvider::MmapPageProvider(HugePages hugePages, Purge purge,
+	std::size_t reserveSize)
+	: hugePages_(hugePages)
+	, purge_(purge)
+	, reserveSize_((reserveSize + SOALLOC_HUGE_PAGE_SIZE - 1) &
+		~(SOALLOC_HUGE_PAGE_SIZE - 1))
+	, next_(nullptr)
+	, end_(nullptr)
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// MmapPageProvider::~MmapPageProvider
+// Unmaps every reserved range, all chunks must have been released
+////////////////////////////////////////////////////////////////////////////////
+
+MmapPageProvider::~MmapPageProvider()
+{
+	for (auto& range: ranges_)
+		::munmap(range.first, range.second);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// MmapPageProvider::Allocate
+// Reuses a released range of the same length, or carves a new one from the
+//     current reservation
+////////////////////////////////////////////////////////////////////////////////
+
+void* MmapPageProvider::Allocate(std::size_t length)
+{
+	assert(length % SOALLOC_PAGE_SIZE == 0);
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	// Pages left to the kernel may still be resident
+	for (auto* released: { &lazy_, &free_ })
+	{
+		auto it = released->find(length);
+		if (it != released->end() && !it->second.empty())
+		{
+			void* p = it->second.back();
+			it->second.pop_back();
+			return p;
+		}
+	}
+
+	// Huge pages are only of use when chunks do not straddle them
+	const std::size_t align = length >= SOALLOC_HUGE_PAGE_SIZE &&
+		hugePages_ != NO_HUGE_PAGES ? SOALLOC_HUGE_PAGE_SIZE : SOALLOC_PAGE_SIZE;
+	char* p = reinterpret_cast<char*>(
+		(reinterpret_cast<std::uintptr_t>(next_) + align - 1) & ~(align - 1));
+	if (!next_ || p + length > end_)
+	{
+		Reserve(length);
+		p = next_;
+	}
+	next_ = p + length;
+	return p;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// MmapPageProvider::Deallocate
+// Drops the physical pages of a chunk and keeps its range for reuse
+////////////////////////////////////////////////////////////////////////////////
+
+void MmapPageProvider::Deallocate(void* p, std::size_t length) noexcept
+{
+	const bool purged = PurgePages(p, length);
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	try
+	{
+		// Trim moves the lazy ranges to free_ and may not allocate
+		std::vector<void*>& ranges = free_[length];
+		const std::size_t needed = ranges.size() + lazy_[length].size() + 1;
+		if (ranges.capacity() < needed)
+			ranges.reserve(std::max(needed, 2 * ranges.capacity()));
+		(purged ? ranges : lazy_[length]).push_back(p);
+	}
+	catch (...)
+	{
+		// the range is lost for reuse, its pages are returned or will be
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// MmapPageProvider::Trim
+// Drops the pages of the chunks released with MADV_FREE, which the kernel
+//     reclaims only under memory pressure
+////////////////////////////////////////////////////////////////////////////////
+
+std::size_t MmapPageProvider::Trim() noexcept
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	std::size_t trimmed = 0;
+	for (auto& released: lazy_)
+	{
+		// Deallocate reserved room for every range
+		std::vector<void*>& ranges = free_.find(released.first)->second;
+		assert(ranges.capacity() - ranges.size() >= released.second.size());
+		for (void* p: released.second)
+		{
+			::madvise(p, released.first, MADV_DONTNEED);
+			ranges.push_back(p);
+			trimmed += released.first;
+		}
+		released.second.clear();
+	}
+	return trimmed;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// MmapPageProvider::PrepareFork
+////////////////////////////////////////////////////////////////////////////////
+
+void MmapPageProvider::PrepareFork() noexcept
+{
+	mutex_.lock();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// MmapPageProvider::AfterFork
+////////////////////////////////////////////////////////////////////////////////
+
+void MmapPageProvider::AfterFork() noexcept
+{
+	mutex_.unlock();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// MmapPageProvider::Reserve (internal)
+// Maps a new range of at least 'length' bytes, aligned to a huge page, and
+//     makes it current. Called with the mutex held
+// A range PageMap does not cover is unmapped again, chunks could not be
+//     found in it
+////////////////////////////////////////////////////////////////////////////////
+
+void MmapPageProvider::Reserve(std::size_t length)
+{
+	std::size_t size = reserveSize_;
+	if (size < length)
+		size = (length + SOALLOC_HUGE_PAGE_SIZE - 1) & ~(SOALLOC_HUGE_PAGE_SIZE - 1);
+
+	ranges_.reserve(ranges_.size() + 1);
+
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+	flags |= MAP_NORESERVE;
+#endif
+	char* p = static_cast<char*>(MAP_FAILED);
+#ifdef MAP_HUGETLB
+	if (hugePages_ == HUGETLB_PAGES)
+	{
+		// Without MAP_NORESERVE the call fails up front when the huge page
+		// pool is short, instead of faulting on first touch
+		p = static_cast<char*>(::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0));
+		if (p != MAP_FAILED && !PageMap::Covers(p, size))
+		{
+			::munmap(p, size);
+			p = static_cast<char*>(MAP_FAILED);
+		}
+		if (p != MAP_FAILED)
+		{
+			ranges_.push_back(std::make_pair(p, size));
+			next_ = p;
+			end_ = p + size;
+			return;
+		}
+	}
+#endif
+
+	// Over-allocate by a huge page to align the range on one
+	p = static_cast<char*>(::mmap(nullptr, size + SOALLOC_HUGE_PAGE_SIZE,
+		PROT_READ | PROT_WRITE, flags, -1, 0));
+	if (p == MAP_FAILED) throw std::bad_alloc();
+
+	char* aligned = reinterpret_cast<char*>(
+		(reinterpret_cast<std::uintptr_t>(p) + SOALLOC_HUGE_PAGE_SIZE - 1) &
+		~(SOALLOC_HUGE_PAGE_SIZE - 1));
+	if (aligned != p) ::munmap(p, aligned - p);
+	if (aligned + size != p + size + SOALLOC_HUGE_PAGE_SIZE)
+		::munmap(aligned + size, p + SOALLOC_HUGE_PAGE_SIZE - aligned);
+	if (!PageMap::Covers(aligned, size))
+	{
+		::munmap(aligned, size);
+		throw std::bad_alloc();
+	}
+
+#ifdef MADV_HUGEPAGE
+	if (hugePages_ != NO_HUGE_PAGES)
+		::madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+
+	ranges_.push_back(std::make_pair(aligned, size));
+	next_ = aligned;
+	end_ = aligned + size;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// MmapPageProvider::PurgePages (internal)
+// Returns the physical pages of a range to the kernel, the range stays mapped
+// Returns false if the kernel may take them only when it runs short
+////////////////////////////////////////////////////////////////////////////////
+
+bool MmapPageProvider::PurgePages(void* p, std::size_t length) noexcept
+{
+	// Huge TLB pages can only be dropped whole
+	if (hugePages_ == HUGETLB_PAGES &&
+		((reinterpret_cast<std::uintptr_t>(p) | length) & (SOALLOC_HUGE_PAGE_SIZE - 1)))
+		return true;
+
+#ifdef MADV_FREE
+	if (purge_ == PURGE_FREE && ::madvise(p, length, MADV_FREE) == 0)
+		return false;
+#endif
+	::madvise(p, length, MADV_DONTNEED);
+	return true;
+}
+
+#endif
+
+// Chunk data starts on a cache line, so that blocks whose size is a multiple
+// of an alignment up to SmallObjAllocator::MAX_BLOCK_ALIGNMENT are aligned
+const std::size_t FixedAllocator::CHUNK_HEADER_SIZE =
+	(sizeof(FixedAllocator::Chunk) + SOALLOC_CACHE_LINE_SIZE - 1) &
+	~std::size_t(SOALLOC_CACHE_LINE_SIZE - 1);
+
 ////////////////////////////////////////////////////////////////////////////////
-// FixedAllocator::Chunk::Init
-// Initializes a chunk object
+// FixedAllocator::Chunk::Create
+// Allocates 'length' bytes of page aligned memory and initializes a chunk
+//     object at its start
 ////////////////////////////////////////////////////////////////////////////////
 
-void FixedAllocator::Chunk::Init(std::size_t blockSize, unsigned char blocks)
+FixedAllocator::Chunk* FixedAllocator::Chunk::Create(std::size_t length,
+	std::size_t blockSize, BlockIndex blocks, FixedAllocator* owner)
 {
 	assert(blockSize > 0);
 	assert(blocks > 0);
 	// Overflow check
 	const std::size_t allocSize = blockSize * blocks;
 	assert(allocSize / blockSize == blocks);
+	assert(CHUNK_HEADER_SIZE + allocSize <= length);
+	(void)allocSize;
 
-	// If this new operator fails, it will throw, and the exception will get
+	// If the provider fails, it will throw, and the exception will get
 	// caught one layer up.
-	m_pData = static_cast<unsigned char*>(::operator new (allocSize));
-	Reset(blockSize, blocks);
+	void* p = owner->provider_->Allocate(length);
+	Chunk* chunk = ::new (p) Chunk;
+	chunk->m_pData = static_cast<unsigned char*>(p) + CHUNK_HEADER_SIZE;
+	chunk->m_owner = owner;
+	chunk->m_list = nullptr;
+	chunk->Reset(blockSize, blocks);
+	try
+	{
+		PageMap::Assign(p, length, chunk);
+	}
+	catch (...)
+	{
+		owner->provider_->Deallocate(p, length);
+		throw;
+	}
+#ifdef SOALLOC_STATS
+	owner->chunkCount_.Add();
+	owner->emptyChunks_.Add();
+#endif
+	return chunk;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 // FixedAllocator::Chunk::Reset
 // Clears an already allocated chunk
+// The blocks are not touched: their memory is first written when they are
+//     handed out
 ////////////////////////////////////////////////////////////////////////////////
 
-void FixedAllocator::Chunk::Reset(std::size_t blockSize, unsigned char blocks)
+void FixedAllocator::Chunk::Reset(std::size_t blockSize, BlockIndex blocks)
 {
 	assert(blockSize > 0);
 	assert(blocks > 0);
 	// Overflow check
 	assert((blockSize * blocks) / blockSize == blocks);
+	(void)blockSize;
 
 	m_firstAvailableBlock = 0;
+	m_firstUntouchedBlock = 0;
 	m_blocksAvailable = blocks;
-
-	unsigned char i = 0;
-	for (unsigned char* p = m_pData; i != blocks; p += blockSize)
-	{
-		*p = ++i;
-	}
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -52,10 +472,16 @@ void FixedAllocator::Chunk::Reset(std::size_t blockSize, unsigned char blocks)
 // Releases the data managed by a chunk
 ////////////////////////////////////////////////////////////////////////////////
 
-void FixedAllocator::Chunk::Release()
+void FixedAllocator::Chunk::Release(std::size_t length)
 {
 	assert(m_pData != nullptr);
-	::operator delete (m_pData);
+#ifdef SOALLOC_STATS
+	m_owner->releases_.Add();
+	m_owner->chunkCount_.Sub();
+	m_owner->emptyChunks_.Sub();
+#endif
+	PageMap::Assign(this, length, nullptr);
+	m_owner->provider_->Deallocate(this, length);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -72,12 +498,47 @@ void* FixedAllocator::Chunk::Allocate(std::size_t blockSize)
 
 	unsigned char* pResult =
 		m_pData + (m_firstAvailableBlock * blockSize);
-	m_firstAvailableBlock = *pResult;
+	// The free list is empty when it points at the untouched blocks
+	if (m_firstAvailableBlock == m_firstUntouchedBlock)
+		m_firstAvailableBlock = ++m_firstUntouchedBlock;
+	else
+		m_firstAvailableBlock = *reinterpret_cast<BlockIndex*>(pResult);
 	--m_blocksAvailable;
 
 	return pResult;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// FixedAllocator::Chunk::Allocate
+// Pops up to 'n' blocks off the free list, then carves untouched ones, into
+//     'out', returns how many
+////////////////////////////////////////////////////////////////////////////////
+
+std::size_t FixedAllocator::Chunk::Allocate(std::size_t blockSize,
+	std::size_t n, void** out)
+{
+	if (n > m_blocksAvailable) n = m_blocksAvailable;
+
+	std::size_t i = 0;
+	BlockIndex next = m_firstAvailableBlock;
+	for (; i < n && next != m_firstUntouchedBlock; ++i)
+	{
+		unsigned char* p = m_pData + next * blockSize;
+		out[i] = p;
+		next = *reinterpret_cast<BlockIndex*>(p);
+	}
+	for (unsigned char* p = m_pData + next * blockSize; i < n; ++i, ++next)
+	{
+		out[i] = p;
+		p += blockSize;
+	}
+	if (next > m_firstUntouchedBlock) m_firstUntouchedBlock = next;
+	m_firstAvailableBlock = next;
+	m_blocksAvailable = static_cast<BlockIndex>(m_blocksAvailable - n);
+
+	return n;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // FixedAllocator::Chunk::Deallocate
 // Dellocates a block from a chunk
@@ -91,8 +552,8 @@ void FixedAllocator::Chunk::Deallocate(void* p, std::size_t blockSize)
 	// Alignment check
 	assert((toRelease - m_pData) % blockSize == 0);
 
-	*toRelease = m_firstAvailableBlock;
-	m_firstAvailableBlock = static_cast<unsigned char>(
+	*reinterpret_cast<BlockIndex*>(toRelease) = m_firstAvailableBlock;
+	m_firstAvailableBlock = static_cast<BlockIndex>(
 		(toRelease - m_pData) / blockSize);
 	// Truncation check
 	assert(m_firstAvailableBlock == (toRelease - m_pData) / blockSize);
@@ -101,93 +562,128 @@ void FixedAllocator::Chunk::Deallocate(void* p, std::size_t blockSize)
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// FixedAllocator::FixedAllocator
-// Creates a FixedAllocator object of a fixed block size
+// FixedAllocator::ChunkList::PushFront
 ////////////////////////////////////////////////////////////////////////////////
 
-FixedAllocator::FixedAllocator(std::size_t blockSize)
-	: blockSize_(blockSize)
-	, allocChunk_(0)
-	, deallocChunk_(0)
+void FixedAllocator::ChunkList::PushFront(Chunk* chunk)
 {
-	assert(blockSize_ > 0);
-
-	prev_ = next_ = this;
+	assert(chunk->m_list == nullptr);
 
-	std::size_t numBlocks = DEFAULT_CHUNK_SIZE / blockSize;
-	if (numBlocks > UCHAR_MAX) numBlocks = UCHAR_MAX;
-	else if (numBlocks == 0) numBlocks = 8 * blockSize;
-
-	numBlocks_ = static_cast<unsigned char>(numBlocks);
-	assert(numBlocks_ == numBlocks);
+	chunk->m_list = this;
+	chunk->m_prev = nullptr;
+	chunk->m_next = m_first;
+	if (m_first) m_first->m_prev = chunk;
+	m_first = chunk;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// FixedAllocator::FixedAllocator(const FixedAllocator&)
-// Creates a FixedAllocator object of a fixed block size
+// FixedAllocator::ChunkList::Remove
 ////////////////////////////////////////////////////////////////////////////////
 
-FixedAllocator::FixedAllocator(const FixedAllocator& rhs)
-	: blockSize_(rhs.blockSize_)
-	, numBlocks_(rhs.numBlocks_)
-	, chunks_(rhs.chunks_)
+void FixedAllocator::ChunkList::Remove(Chunk* chunk)
 {
-	prev_ = &rhs;
-	next_ = rhs.next_;
-	rhs.next_->prev_ = this;
-	rhs.next_ = this;
+	assert(chunk->m_list == this);
 
-	allocChunk_ = rhs.allocChunk_
-		? &chunks_.front() + (rhs.allocChunk_ - &rhs.chunks_.front())
-		: 0;
+	if (chunk->m_prev) chunk->m_prev->m_next = chunk->m_next;
+	else m_first = chunk->m_next;
+	if (chunk->m_next) chunk->m_next->m_prev = chunk->m_prev;
+	chunk->m_list = nullptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// FixedAllocator::FixedAllocator
+// Creates an empty FixedAllocator, Initialize sets its block size
+////////////////////////////////////////////////////////////////////////////////
 
-	deallocChunk_ = rhs.deallocChunk_
-		? &chunks_.front() + (rhs.deallocChunk_ - &rhs.chunks_.front())
-		: 0;
+FixedAllocator::FixedAllocator()
+	: blockSize_(0)
+	, chunkLength_(0)
+	, numBlocks_(0)
+	, allocChunk_(0)
+	, heap_(0)
+	, provider_(0)
+	, maxFreeChunks_(0)
+	, freeChunkCount_(0)
+	, ticks_(0)
+	, nextDecay_(0)
+	, periodTicks_(0)
+{
 }
 
-FixedAllocator& FixedAllocator::operator=(const FixedAllocator& rhs)
+////////////////////////////////////////////////////////////////////////////////
+// FixedAllocator::Initialize
+// Sets the block size, the chunk size, the owning heap and the retention
+//     policy, must be called before any allocation
+////////////////////////////////////////////////////////////////////////////////
+
+void FixedAllocator::Initialize(std::size_t blockSize, std::size_t chunkSize,
+	SmallObjAllocator* heap, PageProvider* provider,
+	const RetentionPolicy& retention)
 {
-	FixedAllocator copy(rhs);
-	copy.Swap(*this);
-	return *this;
+	assert(blockSize >= sizeof(BlockIndex));
+	assert(allocChunk_ == nullptr);
+	assert(provider);
+
+	blockSize_ = blockSize;
+	heap_ = heap;
+	provider_ = provider;
+
+	// Chunks occupy whole pages so that PageMap can find them, and hold at
+	// least 8 blocks
+	if (chunkSize > MAX_CHUNK_SIZE) chunkSize = MAX_CHUNK_SIZE;
+	if (chunkSize < CHUNK_HEADER_SIZE + 8 * blockSize)
+		chunkSize = CHUNK_HEADER_SIZE + 8 * blockSize;
+	chunkLength_ = (chunkSize + SOALLOC_PAGE_SIZE - 1) & ~(SOALLOC_PAGE_SIZE - 1);
+
+	std::size_t numBlocks = (chunkLength_ - CHUNK_HEADER_SIZE) / blockSize;
+	if (numBlocks > std::numeric_limits<BlockIndex>::max())
+		numBlocks = std::numeric_limits<BlockIndex>::max();
+
+	numBlocks_ = static_cast<BlockIndex>(numBlocks);
+	assert(numBlocks_ == numBlocks);
+
+	SetRetention(retention);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// FixedAllocator::~FixedAllocator
+// FixedAllocator::SetRetention
+// Changes how many free chunks are kept and starts a new decay period
 ////////////////////////////////////////////////////////////////////////////////
 
-FixedAllocator::~FixedAllocator()
+void FixedAllocator::SetRetention(const RetentionPolicy& retention)
 {
-	if (prev_ != this)
-	{
-		prev_->next_ = next_;
-		next_->prev_ = prev_;
-		return;
-	}
+	assert(chunkLength_ > 0);
+
+	retention_ = retention;
+	maxFreeChunks_ = retention.maxEmptyBytes / chunkLength_;
+	if (maxFreeChunks_ > retention.maxEmptyChunks)
+		maxFreeChunks_ = retention.maxEmptyChunks;
 
-	assert(prev_ == next_);
-	Chunks::iterator i = chunks_.begin();
-	for (; i != chunks_.end(); ++i)
+	while (freeChunkCount_ > maxFreeChunks_)
 	{
-		assert(i->m_blocksAvailable == numBlocks_);
-		i->Release();
+		Chunk* chunk = freeChunks_.m_first;
+		freeChunks_.Remove(chunk);
+		--freeChunkCount_;
+		chunk->Release(chunkLength_);
 	}
+
+	periodTicks_ = ticks_;
+	if (retention_.decayTime.count())
+		periodStart_ = std::chrono::steady_clock::now();
+	ScheduleDecay();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// FixedAllocator::Swap
+// FixedAllocator::~FixedAllocator
 ////////////////////////////////////////////////////////////////////////////////
 
-void FixedAllocator::Swap(FixedAllocator& rhs)
+FixedAllocator::~FixedAllocator()
 {
-	using namespace std;
+	assert(partialChunks_.m_first == nullptr);
+	assert(fullChunks_.m_first == nullptr);
 
-	swap(blockSize_, rhs.blockSize_);
-	swap(numBlocks_, rhs.numBlocks_);
-	chunks_.swap(rhs.chunks_);
-	swap(allocChunk_, rhs.allocChunk_);
-	swap(deallocChunk_, rhs.deallocChunk_);
+	ReleaseEmptyChunks();
+	assert(allocChunk_ == nullptr);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -198,180 +694,574 @@ void FixedAllocator::Swap(FixedAllocator& rhs)
 void* FixedAllocator::Allocate()
 {
 	if (allocChunk_ == nullptr || allocChunk_->m_blocksAvailable == 0)
-	{
-//		Chunks::iterator i = chunks_.begin();
-//		for (;; ++i)
-		allocChunk_ = nullptr;
-		for(auto const &i: chunks_)
-		{
-/*			if (i == chunks_.end())
-			{
-				// Initialize
-				chunks_.reserve(chunks_.size() + 1);
-				Chunk newChunk;
-				newChunk.Init(blockSize_, numBlocks_);
-				chunks_.push_back(newChunk);
-				allocChunk_ = &chunks_.back();
-				deallocChunk_ = &chunks_.front();
-				break;
-			}	see below... */
-			if (i.m_blocksAvailable > 0)
-			{
-				allocChunk_ = const_cast<Chunk*>(&i);
-				break;
-			}
-		}
-		if (allocChunk_ == nullptr)
-		{
-			// Initialize
-			chunks_.reserve(chunks_.size() + 1);
-			Chunk newChunk;
-			newChunk.Init(blockSize_, numBlocks_);
-			chunks_.push_back(newChunk);
-			allocChunk_ = &chunks_.back();
-			deallocChunk_ = &chunks_.front();
-		}
-
-	}
+		FindChunk();
 	assert(allocChunk_ != 0);
 	assert(allocChunk_->m_blocksAvailable > 0);
 
+#ifdef SOALLOC_STATS
+	if (allocChunk_->m_blocksAvailable == numBlocks_) emptyChunks_.Sub();
+	allocations_.Add();
+	highWater_.Max(allocations_.Get() - deallocations_.Get());
+#endif
 	return allocChunk_->Allocate(blockSize_);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// FixedAllocator::Deallocate
-// Deallocates a block previously allocated with Allocate
-// (undefined behavior if called with the wrong pointer)
+// FixedAllocator::AllocateBatch
+// Allocates 'n' blocks into 'out', taking whole runs from every chunk
+// Either all blocks are allocated or none and the exception is rethrown
+////////////////////////////////////////////////////////////////////////////////
+
+void FixedAllocator::AllocateBatch(std::size_t n, void** out)
+{
+	std::size_t done = 0;
+	try
+	{
+		while (done < n)
+		{
+			if (allocChunk_ == nullptr || allocChunk_->m_blocksAvailable == 0)
+				FindChunk();
+#ifdef SOALLOC_STATS
+			if (allocChunk_->m_blocksAvailable == numBlocks_) emptyChunks_.Sub();
+#endif
+			done += allocChunk_->Allocate(blockSize_, n - done, out + done);
+		}
+	}
+	catch (...)
+	{
+		DeallocateBatch(out, done);
+		throw;
+	}
+#ifdef SOALLOC_STATS
+	allocations_.Add(n);
+	highWater_.Max(allocations_.Get() - deallocations_.Get());
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// FixedAllocator::FindChunk (internal)
+// Points allocChunk_ to a chunk with a free block, creates one if all are full
+// Partially used chunks come first, so that free chunks stay free
 ////////////////////////////////////////////////////////////////////////////////
 
-void FixedAllocator::Deallocate(void* p)
+void FixedAllocator::FindChunk()
 {
-	assert(!chunks_.empty());
-	assert(&chunks_.front() <= deallocChunk_);
-	assert(&chunks_.back() >= deallocChunk_);
+#ifdef SOALLOC_STATS
+	refills_.Add();
+#endif
+	// The exhausted chunk waits among the full ones until a block comes back
+	if (allocChunk_)
+	{
+		assert(allocChunk_->m_blocksAvailable == 0);
+		fullChunks_.PushFront(allocChunk_);
+		allocChunk_ = nullptr;
+	}
 
-	deallocChunk_ = VicinityFind(p);
-	assert(deallocChunk_);
+	if (Chunk* chunk = partialChunks_.m_first)
+	{
+		partialChunks_.Remove(chunk);
+		allocChunk_ = chunk;
+		return;
+	}
+	// The most recently freed chunk is the likeliest to be still cached
+	if (Chunk* chunk = freeChunks_.m_first)
+	{
+		freeChunks_.Remove(chunk);
+		--freeChunkCount_;
+#ifdef SOALLOC_STATS
+		reuses_.Add();
+#endif
+		allocChunk_ = chunk;
+		return;
+	}
+	if (Chunk* chunk = TakeTransferred())
+	{
+		allocChunk_ = chunk;
+		return;
+	}
 
-	DoDeallocate(p);
+	allocChunk_ = Chunk::Create(chunkLength_, blockSize_, numBlocks_, this);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// FixedAllocator::VicinityFind (internal)
-// Finds the chunk corresponding to a pointer, using an efficient search
+// FixedAllocator::Deallocate
+// Deallocates a block previously allocated with Allocate, returns the bytes
+//     given back to the page provider meanwhile
+// (undefined behavior if called with the wrong pointer)
 ////////////////////////////////////////////////////////////////////////////////
 
-FixedAllocator::Chunk* FixedAllocator::VicinityFind(void* p)
+std::size_t FixedAllocator::Deallocate(void* p)
 {
-	assert(!chunks_.empty());
-	assert(deallocChunk_);
+	Chunk* chunk = static_cast<Chunk*>(PageMap::Find(p));
+	assert(chunk);
+	assert(chunk->m_owner == this);
 
-	const std::size_t chunkLength = numBlocks_ * blockSize_;
-
-	Chunk* lo = deallocChunk_;
-	Chunk* hi = deallocChunk_ + 1;
-	Chunk* loBound = &chunks_.front();
-	Chunk* hiBound = &chunks_.back() + 1;
+	return DoDeallocate(chunk, p);
+}
 
-	// Special case: deallocChunk_ is the last in the array
-	if (hi == hiBound) hi = 0;
+////////////////////////////////////////////////////////////////////////////////
+// FixedAllocator::DeallocateBatch
+// Deallocates the leading blocks of 'p' that belong to this allocator and
+//     returns how many, stopping at the first one that does not
+// Consecutive blocks of the same chunk cost a single chunk lookup
+////////////////////////////////////////////////////////////////////////////////
 
-	for (;;)
+std::size_t FixedAllocator::DeallocateBatch(void** p, std::size_t n)
+{
+	std::size_t i = 0;
+	while (i < n)
 	{
-		if (lo)
-		{
-			//if (p >= lo->pData_ && p < lo->pData_ + chunkLength)
-			if (static_cast<size_t>(static_cast<unsigned char*>(p) - lo->m_pData) < chunkLength)
-			{
-				return lo;
-			}
-			if (lo == loBound) lo = 0;
-			else --lo;
-		}
-
-		if (hi)
+		Chunk* chunk = static_cast<Chunk*>(PageMap::Find(p[i]));
+		assert(chunk);
+		if (chunk->m_owner != this) break;
+
+		// Every block of the run but the last one goes straight to the chunk,
+		// the last one may empty it and goes through DoDeallocate
+		const unsigned char* begin = chunk->m_pData;
+		const unsigned char* end = begin + numBlocks_ * blockSize_;
+		std::size_t last = i;
+		while (last + 1 < n &&
+			static_cast<const unsigned char*>(p[last + 1]) >= begin &&
+			static_cast<const unsigned char*>(p[last + 1]) < end)
 		{
-			if (p >= hi->m_pData && p < hi->m_pData + chunkLength)
-			{
-				return hi;
-			}
-			if (++hi == hiBound) hi = 0;
+			chunk->Deallocate(p[last], blockSize_);
+			++last;
 		}
+#ifdef SOALLOC_STATS
+		deallocations_.Add(last - i);
+#endif
+		DoDeallocate(chunk, p[last]);
+		i = last + 1;
 	}
+	return i;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// FixedAllocator::OwnerOf
+// Finds the allocator of the chunk holding 'p', nullptr if 'p' does not
+//     belong to any chunk
+// Safe to call from any thread while the block is still allocated
+////////////////////////////////////////////////////////////////////////////////
 
-	// assert(false);
-	// return 0;
+FixedAllocator* FixedAllocator::OwnerOf(const void* p) noexcept
+{
+	const Chunk* chunk = static_cast<const Chunk*>(PageMap::Find(p));
+	return chunk ? chunk->m_owner : nullptr;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 // FixedAllocator::DoDeallocate (internal)
-// Performs deallocation. Assumes deallocChunk_ points to the correct chunk
+// Performs deallocation and moves 'chunk' to the list matching its free
+//     blocks
+// A chunk that becomes free is kept for reuse as long as the retention
+//     policy allows, and released at once otherwise
+// Returns the bytes released, by the decay too
 ////////////////////////////////////////////////////////////////////////////////
 
-void FixedAllocator::DoDeallocate(void* p)
+std::size_t FixedAllocator::DoDeallocate(Chunk* chunk, void* p)
 {
-	assert(deallocChunk_->m_pData <= p);
-	assert(deallocChunk_->m_pData + numBlocks_ * blockSize_ > p);
+	assert(chunk->m_pData <= p);
+	assert(chunk->m_pData + numBlocks_ * blockSize_ > p);
 
 	// call into the chunk, will adjust the inner list but won't release memory
-	deallocChunk_->Deallocate(p, blockSize_);
-
-	if (deallocChunk_->m_blocksAvailable == numBlocks_)
+	chunk->Deallocate(p, blockSize_);
+
+	const bool empty = chunk->m_blocksAvailable == numBlocks_;
+#ifdef SOALLOC_STATS
+	deallocations_.Add();
+	if (empty) emptyChunks_.Add();
+#endif
+	// Time passes for the decay only while free chunks are kept
+	std::size_t released = 0;
+	if (freeChunks_.m_first && ++ticks_ == nextDecay_) released = Decay();
+
+	if (chunk == allocChunk_) return released;
+	ChunkList* list = empty ? &freeChunks_ : &partialChunks_;
+	if (chunk->m_list == list) return released;
+
+	chunk->m_list->Remove(chunk);
+	if (empty)
 	{
-		// deallocChunk_ is completely free, should we release it? 
-
-		Chunk* lastChunk = &chunks_.back();
+		if (freeChunkCount_ >= maxFreeChunks_)
+			return released + Discard(chunk);
+		chunk->m_idle = false;
+		++freeChunkCount_;
+	}
+	list->PushFront(chunk);
+	return released;
+}
 
-		// deallocChunk_    
-		if (lastChunk == deallocChunk_)
-		{
-			// check if we have two last chunks empty
+////////////////////////////////////////////////////////////////////////////////
+// FixedAllocator::ScheduleDecay (internal)
+// Sets the tick of the next decay check, none if the policy has no decay
+////////////////////////////////////////////////////////////////////////////////
 
-			if (chunks_.size() > 1 &&
-				deallocChunk_[-1].m_blocksAvailable == numBlocks_)
-			{
-				// Two free chunks, discard the last one
-				lastChunk->Release();
-				chunks_.pop_back();
-				allocChunk_ = deallocChunk_ = &chunks_.front(); // <= allocChunk_     ???
-			}
-			return;
+void FixedAllocator::ScheduleDecay()
+{
+	std::uint64_t interval = retention_.decayOperations;
+	if (retention_.decayTime.count() &&
+		(interval == 0 || interval > DECAY_CLOCK_INTERVAL))
+		interval = DECAY_CLOCK_INTERVAL;
+	nextDecay_ = interval ? ticks_ + interval : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// FixedAllocator::Decay (internal)
+// Ends the decay period if it is over: releases half of the free chunks that
+//     stayed unused through it, oldest first, and marks the others
+// Returns the bytes released
+////////////////////////////////////////////////////////////////////////////////
+
+std::size_t FixedAllocator::Decay()
+{
+	ScheduleDecay();
+
+	bool over = retention_.decayOperations != 0 &&
+		ticks_ - periodTicks_ >= retention_.decayOperations;
+	if (retention_.decayTime.count())
+	{
+		const std::chrono::steady_clock::time_point now =
+			std::chrono::steady_clock::now();
+		if (now - periodStart_ >= retention_.decayTime) over = true;
+		if (over) periodStart_ = now;
+	}
+	if (!over) return 0;
+	periodTicks_ = ticks_;
+
+	std::size_t idle = 0;
+	Chunk* last = nullptr;
+	for (Chunk* chunk = freeChunks_.m_first; chunk; chunk = chunk->m_next)
+	{
+		if (chunk->m_idle) ++idle;
+		last = chunk;
+	}
+
+	// Newly freed chunks are pushed to the front, so the oldest are last
+	std::size_t toRelease = (idle + 1) / 2;
+	std::size_t released = 0;
+	for (Chunk* chunk = last; chunk; )
+	{
+		Chunk* prev = chunk->m_prev;
+		if (chunk->m_idle && toRelease)
+		{
+			--toRelease;
+			freeChunks_.Remove(chunk);
+			--freeChunkCount_;
+#ifdef SOALLOC_STATS
+			decays_.Add();
+#endif
+			chunk->Release(chunkLength_);
+			released += chunkLength_;
 		}
-		// deallocChunk_     
-		//        
-		if (lastChunk->m_blocksAvailable == numBlocks_)
+		else
+			chunk->m_idle = true;
+		chunk = prev;
+	}
+	return released;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// FixedAllocator::LendChunk
+// Takes a free chunk, or a new one, out of the allocator and returns its
+//     data, 'length' bytes aligned to a cache line
+////////////////////////////////////////////////////////////////////////////////
+
+void* FixedAllocator::LendChunk(std::size_t& length)
+{
+	Chunk* chunk = freeChunks_.m_first;
+	if (chunk)
+	{
+		freeChunks_.Remove(chunk);
+		--freeChunkCount_;
+#ifdef SOALLOC_STATS
+		reuses_.Add();
+#endif
+	}
+	else if ((chunk = TakeTransferred()) == nullptr)
+		chunk = Chunk::Create(chunkLength_, blockSize_, numBlocks_, this);
+
+#ifdef SOALLOC_STATS
+	emptyChunks_.Sub();
+#endif
+	chunk->m_owner = nullptr;
+	length = chunkLength_ - CHUNK_HEADER_SIZE;
+	return chunk->m_pData;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// FixedAllocator::ReturnChunk
+// Takes back a chunk lent by LendChunk, whatever was written in it, and
+//     keeps it as a free chunk if the retention policy allows
+////////////////////////////////////////////////////////////////////////////////
+
+void FixedAllocator::ReturnChunk(void* data)
+{
+	Chunk* chunk = reinterpret_cast<Chunk*>(
+		static_cast<unsigned char*>(data) - CHUNK_HEADER_SIZE);
+	assert(chunk->m_owner == nullptr);
+	assert(chunk->m_pData == data);
+
+	chunk->m_owner = this;
+	chunk->Reset(blockSize_, numBlocks_);
+#ifdef SOALLOC_STATS
+	emptyChunks_.Add();
+#endif
+	if (freeChunkCount_ >= maxFreeChunks_)
+	{
+		Discard(chunk);
+		return;
+	}
+	chunk->m_idle = false;
+	++freeChunkCount_;
+	freeChunks_.PushFront(chunk);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// FixedAllocator::IsLent
+// Tells whether 'p' is in a chunk lent by LendChunk
+////////////////////////////////////////////////////////////////////////////////
+
+bool FixedAllocator::IsLent(const void* p) noexcept
+{
+	const Chunk* chunk = static_cast<const Chunk*>(PageMap::Find(p));
+	return chunk && chunk->m_owner == nullptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// struct FixedAllocator::TransferCache
+// Completely free chunks that their heaps had no room for, one stack per size
+//     class. A heap takes one before it asks its page provider for a new
+//     chunk, so that one thread does not create chunks while another drops
+//     them
+// Only chunks of the default page provider are shared, any other may be
+//     destroyed with its heap. A stack holds chunks of a single length, that
+//     of the first chunk pushed while it is empty. Chunks in it have no owner
+////////////////////////////////////////////////////////////////////////////////
+
+struct FixedAllocator::TransferCache
+{
+	struct alignas(SOALLOC_CACHE_LINE_SIZE) Stack
+	{
+		std::mutex mutex;
+		Chunk* first = nullptr;
+		// Read without the lock to pass an empty stack by
+		std::atomic<std::size_t> count{ 0 };
+		std::size_t length = 0;
+	};
+
+	Stack stacks[UCHAR_MAX + 1];
+
+	// Heaps may outlive any static object, so the instance is never destroyed
+	static TransferCache& Instance()
+	{
+		alignas(TransferCache) static unsigned char storage[sizeof(TransferCache)];
+		static TransferCache* cache = ::new (storage) TransferCache;
+		return *cache;
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// FixedAllocator::Discard (internal)
+// Pushes a free chunk, out of every list, to the transfer cache, or releases
+//     it if the stack of its size class is full or holds other chunks
+// Returns the bytes released
+////////////////////////////////////////////////////////////////////////////////
+
+std::size_t FixedAllocator::Discard(Chunk* chunk)
+{
+	if (provider_ != &PageProvider::Default())
+	{
+		chunk->Release(chunkLength_);
+		return chunkLength_;
+	}
+
+	TransferCache::Stack& stack =
+		TransferCache::Instance().stacks[SizeClassOf(blockSize_)];
+	{
+		std::lock_guard<std::mutex> lock(stack.mutex);
+		const std::size_t count = stack.count.load(std::memory_order_relaxed);
+		if (count == 0) stack.length = chunkLength_;
+		if (stack.length == chunkLength_ &&
+			(count + 1) * chunkLength_ <= SOALLOC_TRANSFER_CACHE_BYTES)
 		{
-			// Two free blocks, discard one
-			lastChunk->Release();
-			chunks_.pop_back();
-			allocChunk_ = deallocChunk_;	// <= allocChunk_      ,    ???
-			//      
-			lastChunk = &chunks_.back();
-			if (lastChunk == deallocChunk_ || lastChunk->m_blocksAvailable == numBlocks_)
-				return;
+#ifdef SOALLOC_STATS
+			chunkCount_.Sub();
+			emptyChunks_.Sub();
+#endif
+			chunk->m_owner = nullptr;
+			chunk->m_next = stack.first;
+			stack.first = chunk;
+			stack.count.store(count + 1, std::memory_order_relaxed);
+			return 0;
 		}
-//		else
+	}
+	chunk->Release(chunkLength_);
+	return chunkLength_;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// FixedAllocator::TakeTransferred (internal)
+// Takes a free chunk of this allocator's kind from the transfer cache,
+//     nullptr if there is none
+////////////////////////////////////////////////////////////////////////////////
+
+FixedAllocator::Chunk* FixedAllocator::TakeTransferred()
+{
+	TransferCache::Stack& stack =
+		TransferCache::Instance().stacks[SizeClassOf(blockSize_)];
+	if (stack.count.load(std::memory_order_relaxed) == 0 ||
+		provider_ != &PageProvider::Default())
+		return nullptr;
+
+	Chunk* chunk;
+	{
+		std::lock_guard<std::mutex> lock(stack.mutex);
+		chunk = stack.first;
+		if (chunk == nullptr || stack.length != chunkLength_)
+			return nullptr;
+		stack.first = chunk->m_next;
+		stack.count.store(stack.count.load(std::memory_order_relaxed) - 1,
+			std::memory_order_relaxed);
+	}
+
+	chunk->m_owner = this;
+	chunk->m_list = nullptr;
+	chunk->Reset(blockSize_, numBlocks_);
+#ifdef SOALLOC_STATS
+	chunkCount_.Add();
+	emptyChunks_.Add();
+	transfers_.Add();
+#endif
+	return chunk;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// FixedAllocator::ReleaseTransferCache
+// Empties the transfer cache, the chunks have no owner to release them
+////////////////////////////////////////////////////////////////////////////////
+
+std::size_t FixedAllocator::ReleaseTransferCache() noexcept
+{
+	TransferCache& cache = TransferCache::Instance();
+	std::size_t released = 0;
+	for (TransferCache::Stack& stack: cache.stacks)
+	{
+		if (stack.count.load(std::memory_order_relaxed) == 0) continue;
+
+		std::lock_guard<std::mutex> lock(stack.mutex);
+		while (Chunk* chunk = stack.first)
 		{
-			// move the empty chunk to the end
-			std::swap(*deallocChunk_, *lastChunk);
-			allocChunk_ = &chunks_.back();	// <= allocChunk_      ,    ???
+			stack.first = chunk->m_next;
+			PageMap::Assign(chunk, stack.length, nullptr);
+			PageProvider::Default().Deallocate(chunk, stack.length);
+			released += stack.length;
 		}
+		stack.count.store(0, std::memory_order_relaxed);
+	}
+	return released;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// FixedAllocator::PrepareFork
+// Locks the stacks in order, as nothing else holds two of them
+////////////////////////////////////////////////////////////////////////////////
+
+void FixedAllocator::PrepareFork() noexcept
+{
+	for (TransferCache::Stack& stack: TransferCache::Instance().stacks)
+		stack.mutex.lock();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// FixedAllocator::AfterFork
+////////////////////////////////////////////////////////////////////////////////
+
+void FixedAllocator::AfterFork() noexcept
+{
+	for (TransferCache::Stack& stack: TransferCache::Instance().stacks)
+		stack.mutex.unlock();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// FixedAllocator::TransferCacheBytes
+// Sums the stacks of the transfer cache without locking them
+////////////////////////////////////////////////////////////////////////////////
+
+std::size_t FixedAllocator::TransferCacheBytes() noexcept
+{
+	const TransferCache& cache = TransferCache::Instance();
+	std::size_t bytes = 0;
+	for (const TransferCache::Stack& stack: cache.stacks)
+	{
+		if (const std::size_t count = stack.count.load(std::memory_order_relaxed))
+			bytes += count * stack.length;
 	}
+	return bytes;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// FixedAllocator::ReleaseEmptyChunks (internal)
+// Gives every completely free chunk back to the page provider, returns the
+//     bytes released
+////////////////////////////////////////////////////////////////////////////////
+
+std::size_t FixedAllocator::ReleaseEmptyChunks()
+{
+	std::size_t released = 0;
+	while (Chunk* chunk = freeChunks_.m_first)
+	{
+		freeChunks_.Remove(chunk);
+		chunk->Release(chunkLength_);
+		released += chunkLength_;
+	}
+	freeChunkCount_ = 0;
+	if (allocChunk_ && allocChunk_->m_blocksAvailable == numBlocks_)
+	{
+		allocChunk_->Release(chunkLength_);
+		allocChunk_ = nullptr;
+		released += chunkLength_;
+	}
+	return released;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 // SmallObjAllocator::SmallObjAllocator
-// Creates an allocator for small objects given chunk size and maximum 'small'
-//     object size
+// Creates an allocator for small objects given chunk size, maximum 'small'
+//     object size and the source of chunk memory
+// Builds a FixedAllocator for every size class up front, so that allocation
+//     never searches or inserts
 ////////////////////////////////////////////////////////////////////////////////
 
 SmallObjAllocator::SmallObjAllocator(
 	std::size_t chunkSize,
-	std::size_t maxObjectSize)
-	: pLastAlloc_(0), pLastDealloc_(0)
-	, chunkSize_(chunkSize), maxObjectSize_(maxObjectSize)
+	std::size_t maxObjectSize,
+	PageProvider* provider,
+	const RetentionPolicy& retention)
+	: chunkSize_(chunkSize), maxObjectSize_(maxObjectSize)
+	, provider_(provider ? provider : &PageProvider::Default())
+	, remoteFrees_(nullptr)
+{
+	const std::size_t numClasses = SizeClassOf(maxObjectSize_) + 1;
+	assert(numClasses <= UCHAR_MAX + 1);
+
+	pool_.reset(new FixedAllocator[numClasses]);
+	for (std::size_t i = 0; i < numClasses; ++i)
+		pool_[i].Initialize(SizeOfClass(i), chunkSize_, this, provider_,
+			retention);
+
+	sizeClasses_.resize((maxObjectSize_ + 15) / 16 + 1);
+	for (std::size_t i = 0; i < sizeClasses_.size(); ++i)
+		sizeClasses_[i] = static_cast<unsigned char>(SizeClassOf(i * 16));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SmallObjAllocator::~SmallObjAllocator
+// Takes back the blocks other threads have queued since the last operation
+////////////////////////////////////////////////////////////////////////////////
+
+SmallObjAllocator::~SmallObjAllocator()
 {
+	DrainRemoteFrees();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -382,43 +1272,899 @@ SmallObjAllocator::SmallObjAllocator(
 
 void* SmallObjAllocator::Allocate(std::size_t numBytes)
 {
-//	std::lock_guard<std::mutex> lguard(m_mutex);
+	void* p;
+	if (numBytes > maxObjectSize_)
+	{
+#ifdef SOALLOC_STATS
+		largeAllocations_.Add();
+#endif
+		p = operator new(numBytes);
+	}
+	else
+	{
+		if (remoteFrees_.load(std::memory_order_relaxed)) DrainRemoteFrees();
 
-	if (numBytes > maxObjectSize_) return operator new(numBytes);
+		p = pool_[sizeClasses_[(numBytes + 15) >> 4]].Allocate();
+	}
+#ifdef SOALLOC_TRACE
+	TraceRecorder::Record(TraceOp::Allocate, p, numBytes, BLOCK_ALIGNMENT);
+#endif
+	return p;
+}
 
-	if (pLastAlloc_ && pLastAlloc_->BlockSize() == numBytes)
+////////////////////////////////////////////////////////////////////////////////
+// SmallObjAllocator::Allocate
+// Allocates 'numBytes' memory aligned to 'alignment'
+// The size is rounded up to the alignment: its size class is then a multiple
+//     of the alignment, and so is every block of the class
+////////////////////////////////////////////////////////////////////////////////
+
+void* SmallObjAllocator::Allocate(std::size_t numBytes, std::size_t alignment)
+{
+	assert((alignment & (alignment - 1)) == 0);
+	if (alignment <= BLOCK_ALIGNMENT) return Allocate(numBytes);
+
+	const std::size_t size =
+		((numBytes ? numBytes : 1) + alignment - 1) & ~(alignment - 1);
+	void* p;
+	if (size > maxObjectSize_ || alignment > MAX_BLOCK_ALIGNMENT)
 	{
-		return pLastAlloc_->Allocate();
+#ifdef SOALLOC_STATS
+		largeAllocations_.Add();
+#endif
+		p = operator new(numBytes, std::align_val_t(alignment));
 	}
-	Pool::iterator i = std::lower_bound(pool_.begin(), pool_.end(), numBytes);
-	if (i == pool_.end() || i->BlockSize() != numBytes)
+	else
 	{
-		i = pool_.insert(i, FixedAllocator(numBytes));
-		pLastDealloc_ = &*pool_.begin();
+		if (remoteFrees_.load(std::memory_order_relaxed)) DrainRemoteFrees();
+
+		p = pool_[sizeClasses_[(size + 15) >> 4]].Allocate();
 	}
-	pLastAlloc_ = &*i;
-	return pLastAlloc_->Allocate();
+#ifdef SOALLOC_TRACE
+	TraceRecorder::Record(TraceOp::Allocate, p, numBytes, alignment);
+#endif
+	return p;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 // SmallObjAllocator::Deallocate
-// Deallocates memory previously allocated with Allocate
+// Deallocates memory previously allocated with Allocate by this or any other
+//     heap; blocks of other heaps are queued back to their owners
+// The size class of a block always comes from its chunk: a block larger than
+//     this heap pools may still come from a heap that pools more, such as
+//     one of an AllocatorSingleton
 // (undefined behavior if you pass any other pointer)
 ////////////////////////////////////////////////////////////////////////////////
 
 void SmallObjAllocator::Deallocate(void* p, std::size_t numBytes)
 {
-//	std::lock_guard<std::mutex> lguard(m_mutex);
-	if (numBytes > maxObjectSize_) return operator delete(p);
+#ifdef SOALLOC_TRACE
+	TraceRecorder::Record(TraceOp::Deallocate, p, numBytes, BLOCK_ALIGNMENT);
+#endif
+	// The block may be larger, 'numBytes' can be the size of a base class
+	assert(!FixedAllocator::OwnerOf(p) ||
+		FixedAllocator::OwnerOf(p)->BlockSize() >= numBytes);
+	(void)numBytes;
+	DeallocateBlock(p);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SmallObjAllocator::Deallocate
+// Deallocates memory previously allocated with Allocate without knowing its
+//     size
+////////////////////////////////////////////////////////////////////////////////
+
+void SmallObjAllocator::Deallocate(void* p)
+{
+#ifdef SOALLOC_TRACE
+	TraceRecorder::Record(TraceOp::Deallocate, p, 0, BLOCK_ALIGNMENT);
+#endif
+	DeallocateBlock(p);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SmallObjAllocator::DeallocateBlock (internal)
+// Deallocates a block of any size: a block found in no chunk came from
+//     operator new
+// Blocks of a soalloc_region are freed with the region
+////////////////////////////////////////////////////////////////////////////////
+
+void SmallObjAllocator::DeallocateBlock(void* p)
+{
+	FixedAllocator* owner = FixedAllocator::OwnerOf(p);
+	if (owner == nullptr)
+	{
+		if (FixedAllocator::IsLent(p)) return;
+#ifdef SOALLOC_STATS
+		largeDeallocations_.Add();
+#endif
+		return operator delete(p);
+	}
+	if (owner->Heap() != this)
+	{
+		owner->Heap()->PushRemoteFree(p);
+		return;
+	}
+
+	if (remoteFrees_.load(std::memory_order_relaxed)) DrainRemoteFrees();
+
+	owner->Deallocate(p);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SmallObjAllocator::Deallocate
+// Deallocates memory allocated with the same alignment
+// A block found in no chunk came from the aligned operator new
+////////////////////////////////////////////////////////////////////////////////
+
+void SmallObjAllocator::Deallocate(void* p, std::size_t numBytes,
+	std::size_t alignment)
+{
+	if (alignment <= BLOCK_ALIGNMENT) return Deallocate(p, numBytes);
 
-	if (pLastDealloc_ && pLastDealloc_->BlockSize() == numBytes)
+#ifdef SOALLOC_TRACE
+	TraceRecorder::Record(TraceOp::Deallocate, p, numBytes, alignment);
+#endif
+	if (FixedAllocator::OwnerOf(p) == nullptr)
 	{
-		pLastDealloc_->Deallocate(p);
+		if (FixedAllocator::IsLent(p)) return;
+#ifdef SOALLOC_STATS
+		largeDeallocations_.Add();
+#endif
+		return operator delete(p, std::align_val_t(alignment));
+	}
+	DeallocateBlock(p);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SmallObjAllocator::AllocateBatch
+// Allocates 'n' objects of 'numBytes' memory into 'out'
+// Either all objects are allocated or none and the exception is rethrown
+////////////////////////////////////////////////////////////////////////////////
+
+void SmallObjAllocator::AllocateBatch(std::size_t numBytes, std::size_t n,
+	void** out, std::size_t alignment)
+{
+	if (alignment > BLOCK_ALIGNMENT)
+		numBytes = ((numBytes ? numBytes : 1) + alignment - 1) & ~(alignment - 1);
+	if (numBytes > maxObjectSize_ || alignment > MAX_BLOCK_ALIGNMENT)
+	{
+		std::size_t i = 0;
+		try
+		{
+			for (; i < n; ++i)
+				out[i] = Allocate(numBytes, alignment);
+		}
+		catch (...)
+		{
+			DeallocateBatch(numBytes, out, i, alignment);
+			throw;
+		}
 		return;
 	}
-	Pool::iterator i = std::lower_bound(pool_.begin(), pool_.end(), numBytes);
-	assert(i != pool_.end());
-	assert(i->BlockSize() == numBytes);
-	pLastDealloc_ = &*i;
-	pLastDealloc_->Deallocate(p);
+
+	if (remoteFrees_.load(std::memory_order_relaxed)) DrainRemoteFrees();
+
+	pool_[sizeClasses_[(numBytes + 15) >> 4]].AllocateBatch(n, out);
+#ifdef SOALLOC_TRACE
+	for (std::size_t i = 0; i < n; ++i)
+		TraceRecorder::Record(TraceOp::Allocate, out[i], numBytes, alignment);
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SmallObjAllocator::DeallocateBatch
+// Deallocates 'n' objects of 'numBytes' memory allocated by this or any other
+//     heap; blocks of other heaps are queued back to their owners
+////////////////////////////////////////////////////////////////////////////////
+
+void SmallObjAllocator::DeallocateBatch(std::size_t numBytes, void** p,
+	std::size_t n, std::size_t alignment)
+{
+	if (alignment > BLOCK_ALIGNMENT)
+		numBytes = ((numBytes ? numBytes : 1) + alignment - 1) & ~(alignment - 1);
+	if (numBytes > maxObjectSize_ || alignment > MAX_BLOCK_ALIGNMENT)
+	{
+		for (std::size_t i = 0; i < n; ++i)
+			Deallocate(p[i], numBytes, alignment);
+		return;
+	}
+
+	if (remoteFrees_.load(std::memory_order_relaxed)) DrainRemoteFrees();
+
+#ifdef SOALLOC_TRACE
+	for (std::size_t i = 0; i < n; ++i)
+		TraceRecorder::Record(TraceOp::Deallocate, p[i], numBytes, alignment);
+#endif
+	FixedAllocator& allocator = pool_[sizeClasses_[(numBytes + 15) >> 4]];
+	while (n)
+	{
+		const std::size_t done = allocator.DeallocateBatch(p, n);
+		p += done;
+		n -= done;
+		if (n)
+		{
+			// A block of another heap or of a soalloc_region
+			if (FixedAllocator* owner = FixedAllocator::OwnerOf(*p))
+			{
+				assert(owner->Heap() != this);
+				owner->Heap()->PushRemoteFree(*p);
+			}
+			else
+				assert(FixedAllocator::IsLent(*p));
+			++p;
+			--n;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SmallObjAllocator::PushRemoteFree (internal)
+// Queues a block freed by another thread, lock-free for any number of threads
+////////////////////////////////////////////////////////////////////////////////
+
+void SmallObjAllocator::PushRemoteFree(void* p) noexcept
+{
+	void* head = remoteFrees_.load(std::memory_order_relaxed);
+	void* request;
+	do
+	{
+		// The link keeps the trim request too, the head must not lose it
+		*static_cast<void**>(p) = head;
+		request = reinterpret_cast<void*>(
+			reinterpret_cast<std::uintptr_t>(p) |
+			(reinterpret_cast<std::uintptr_t>(head) & TRIM_REQUEST));
+	} while (!remoteFrees_.compare_exchange_weak(head, request,
+		std::memory_order_release, std::memory_order_relaxed));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SmallObjAllocator::DrainRemoteFrees (internal)
+// Takes the whole remote free queue at once and returns its blocks to their
+//     FixedAllocators, then trims the heap if that was requested. Called by
+//     the owning thread only
+// Returns the bytes released meanwhile
+////////////////////////////////////////////////////////////////////////////////
+
+std::size_t SmallObjAllocator::DrainRemoteFrees()
+{
+	const std::uintptr_t head = reinterpret_cast<std::uintptr_t>(
+		remoteFrees_.exchange(nullptr, std::memory_order_acquire));
+	void* p = reinterpret_cast<void*>(head & ~TRIM_REQUEST);
+	std::size_t released = 0;
+	while (p)
+	{
+		void* next = reinterpret_cast<void*>(
+			reinterpret_cast<std::uintptr_t>(*static_cast<void**>(p)) & ~TRIM_REQUEST);
+		released += FixedAllocator::OwnerOf(p)->Deallocate(p);
+		p = next;
+	}
+	if (head & TRIM_REQUEST) released += Trim(false);
+	return released;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SmallObjAllocator::RequestTrim (internal)
+// Has the owner trim the heap on its next allocation or deallocation, which
+//     drains the remote free queue once it is not empty. Called by any thread
+////////////////////////////////////////////////////////////////////////////////
+
+void SmallObjAllocator::RequestTrim() noexcept
+{
+	void* head = remoteFrees_.load(std::memory_order_relaxed);
+	void* request;
+	do
+	{
+		request = reinterpret_cast<void*>(
+			reinterpret_cast<std::uintptr_t>(head) | TRIM_REQUEST);
+	} while (!remoteFrees_.compare_exchange_weak(head, request,
+		std::memory_order_release, std::memory_order_relaxed));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SmallObjAllocator::ReleaseEmptyChunks
+// Takes back the queued remote frees, then releases every empty chunk
+////////////////////////////////////////////////////////////////////////////////
+
+std::size_t SmallObjAllocator::ReleaseEmptyChunks()
+{
+	std::size_t released = DrainRemoteFrees();
+
+	const std::size_t numClasses = SizeClassOf(maxObjectSize_) + 1;
+	for (std::size_t i = 0; i < numClasses; ++i)
+		released += pool_[i].ReleaseEmptyChunks();
+	return released;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SmallObjAllocator::Trim
+// Releases every empty chunk and optionally the pages the provider keeps
+////////////////////////////////////////////////////////////////////////////////
+
+std::size_t SmallObjAllocator::Trim(bool purgePages)
+{
+	std::size_t released = ReleaseEmptyChunks();
+	if (purgePages) released += provider_->Trim();
+	return released;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SmallObjAllocator::SetRetention
+// Sets the retention policy of every size class
+////////////////////////////////////////////////////////////////////////////////
+
+void SmallObjAllocator::SetRetention(const RetentionPolicy& retention)
+{
+	const std::size_t numClasses = SizeClassOf(maxObjectSize_) + 1;
+	for (std::size_t i = 0; i < numClasses; ++i)
+		pool_[i].SetRetention(retention);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SmallObjAllocator::LendChunk (internal)
+// Lends a chunk of the largest size class to a soalloc_region
+////////////////////////////////////////////////////////////////////////////////
+
+void* SmallObjAllocator::LendChunk(std::size_t& length)
+{
+	return pool_[SizeClassOf(maxObjectSize_)].LendChunk(length);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SmallObjAllocator::ReturnChunk (internal)
+////////////////////////////////////////////////////////////////////////////////
+
+void SmallObjAllocator::ReturnChunk(void* data)
+{
+	pool_[SizeClassOf(maxObjectSize_)].ReturnChunk(data);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// soalloc_region::soalloc_region
+// Creates an empty region on the heap of the calling thread and makes it the
+//     current one
+////////////////////////////////////////////////////////////////////////////////
+
+soalloc_region::soalloc_region()
+	: heap_(ThreadHeap::Get().Heap())
+	, previous_(current_)
+	, chunks_(nullptr)
+	, large_(nullptr)
+	, next_(nullptr)
+	, end_(nullptr)
+{
+	current_ = this;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// soalloc_region::~soalloc_region
+// Frees everything allocated in the region, O(chunks)
+////////////////////////////////////////////////////////////////////////////////
+
+soalloc_region::~soalloc_region()
+{
+	assert(current_ == this);
+	current_ = previous_;
+
+	while (LargeBlock* block = large_)
+	{
+		large_ = block->next;
+		operator delete(block, std::align_val_t(block->alignment));
+	}
+	while (void* data = chunks_)
+	{
+		chunks_ = *static_cast<void**>(data);
+		ThreadHeap::Get(heap_)->ReturnChunk(data);
+	}
 }
+
+////////////////////////////////////////////////////////////////////////////////
+// soalloc_region::AllocateSlow (internal)
+// Serves what the current chunk cannot: aligns, starts a new chunk, or gets
+//     a block too large for any chunk from operator new
+////////////////////////////////////////////////////////////////////////////////
+
+void* soalloc_region::AllocateSlow(std::size_t numBytes, std::size_t alignment)
+{
+	assert((alignment & (alignment - 1)) == 0);
+	if (alignment < SmallObjAllocator::BLOCK_ALIGNMENT)
+		alignment = SmallObjAllocator::BLOCK_ALIGNMENT;
+
+	std::size_t length;
+	if (chunks_ == nullptr)
+	{
+		// Learn the chunk length from the first chunk
+		void* data = ThreadHeap::Get(heap_)->LendChunk(length);
+		*static_cast<void**>(data) = nullptr;
+		chunks_ = data;
+		next_ = static_cast<unsigned char*>(data) + SmallObjAllocator::BLOCK_ALIGNMENT;
+		end_ = static_cast<unsigned char*>(data) + length;
+	}
+	else
+	{
+		length = static_cast<std::size_t>(
+			end_ - static_cast<unsigned char*>(chunks_));
+	}
+
+	// A fresh chunk fits it once aligned past the link word
+	if (numBytes > length - alignment || alignment > SmallObjAllocator::MAX_BLOCK_ALIGNMENT)
+	{
+		// The header keeps the block aligned
+		static_assert(sizeof(LargeBlock) <= SmallObjAllocator::BLOCK_ALIGNMENT,
+			"LargeBlock header");
+		if (numBytes > std::numeric_limits<std::size_t>::max() - alignment)
+			throw std::bad_alloc();
+		LargeBlock* block = static_cast<LargeBlock*>(
+			operator new(alignment + numBytes, std::align_val_t(alignment)));
+		block->next = large_;
+		block->alignment = alignment;
+		large_ = block;
+		return reinterpret_cast<unsigned char*>(block) + alignment;
+	}
+
+	const std::size_t size = ((numBytes ? numBytes : 1) + 15) & ~std::size_t(15);
+	unsigned char* p = reinterpret_cast<unsigned char*>(
+		(reinterpret_cast<std::uintptr_t>(next_) + alignment - 1) & ~(alignment - 1));
+	if (p > end_ || size > static_cast<std::size_t>(end_ - p))
+	{
+		void* data = ThreadHeap::Get(heap_)->LendChunk(length);
+		*static_cast<void**>(data) = chunks_;
+		chunks_ = data;
+		end_ = static_cast<unsigned char*>(data) + length;
+		p = static_cast<unsigned char*>(data) + alignment;
+	}
+	next_ = p + size;
+	return p;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// HeapRegistry::Adopt
+// Takes the heap of an exited thread, or creates one with the configuration
+//     of the registry
+////////////////////////////////////////////////////////////////////////////////
+
+SmallObjAllocator* HeapRegistry::Adopt()
+{
+	std::unique_lock<std::shared_mutex> lock(mutex);
+	if (!orphans.empty())
+	{
+		SmallObjAllocator* heap = orphans.back();
+		orphans.pop_back();
+		return heap;
+	}
+	heaps.emplace_back(chunkSize, maxObjectSize, provider);
+	// Orphan must not allocate
+	orphans.reserve(heaps.size());
+	return &heaps.back();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// HeapRegistry::Orphan
+// Releases the empty chunks of the heap of an exiting thread and leaves the
+//     heap, with any blocks still in use, to the next new thread
+////////////////////////////////////////////////////////////////////////////////
+
+void HeapRegistry::Orphan(SmallObjAllocator* heap) noexcept
+{
+	ThreadHeap::Scope scope;
+	heap->ReleaseEmptyChunks();
+
+	std::unique_lock<std::shared_mutex> lock(mutex);
+	orphans.push_back(heap);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ThreadHeap::Trim
+// Trims the heaps nobody uses now and asks the owners of the others to trim
+//     theirs
+////////////////////////////////////////////////////////////////////////////////
+
+std::size_t ThreadHeap::Trim(bool purgePages)
+{
+	Scope scope;
+	HeapRegistry& registry = PoolAllocator::GetInstance();
+	std::size_t released = 0;
+	{
+		// Keeps orphans from being adopted meanwhile
+		std::unique_lock<std::shared_mutex> lock(registry.mutex);
+#ifdef SOALLOC_PER_CPU
+		for (SmallObjAllocator* heap: registry.cpuHeaps)
+			released += Get(heap)->Trim(false);
+#else
+		// Heaps trimmed here get no request, it would be served in the
+		// middle of their Trim
+		SmallObjAllocator* const current = Threads::Current();
+		for (SmallObjAllocator& heap: registry.heaps)
+		{
+			if (&heap != current && std::find(registry.orphans.begin(),
+				registry.orphans.end(), &heap) == registry.orphans.end())
+				heap.RequestTrim();
+		}
+		for (SmallObjAllocator* heap: registry.orphans)
+			released += heap->Trim(false);
+		if (current) released += current->Trim(false);
+#endif
+	}
+	released += FixedAllocator::ReleaseTransferCache();
+	if (purgePages) released += PageProvider::Default().Trim();
+	return released;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ThreadHeap::PrepareFork
+// Locks in the order the locks nest in: the registry, in per CPU mode every
+//     heap, the transfer cache, the default page provider and the page map
+////////////////////////////////////////////////////////////////////////////////
+
+void ThreadHeap::PrepareFork() noexcept
+{
+	// Whatever soalloc allocates for itself from here on, such as the
+	// provider on first use, must not come back to the registry
+	Scope scope;
+	PageProvider& provider = PageProvider::Default();
+	HeapRegistry& registry = PoolAllocator::GetInstance();
+
+	registry.mutex.lock();
+#ifdef SOALLOC_PER_CPU
+	for (SmallObjAllocator* heap: registry.cpuHeaps)
+		heap->Lock();
+#endif
+	FixedAllocator::PrepareFork();
+	provider.PrepareFork();
+	PageMap::PrepareFork();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ThreadHeap::AfterFork
+// Unlocks what PrepareFork locked, in reverse order
+////////////////////////////////////////////////////////////////////////////////
+
+void ThreadHeap::AfterFork() noexcept
+{
+	HeapRegistry& registry = PoolAllocator::GetInstance();
+
+	PageMap::AfterFork();
+	PageProvider::Default().AfterFork();
+	FixedAllocator::AfterFork();
+#ifdef SOALLOC_PER_CPU
+	for (SmallObjAllocator* heap: registry.cpuHeaps)
+		heap->Unlock();
+#endif
+	registry.mutex.unlock();
+}
+
+#ifdef SOALLOC_PER_CPU
+
+namespace
+{
+
+std::atomic<unsigned> nextStripe{ 0 };
+
+// The CPU the calling thread runs on, as rseq keeps it; without rseq a
+//     stripe given to the thread on its first call
+unsigned CurrentCpu() noexcept
+{
+#ifdef SOALLOC_HAS_RSEQ
+	if (__rseq_size != 0)
+	{
+		const struct rseq* area = reinterpret_cast<const struct rseq*>(
+			static_cast<const char*>(__builtin_thread_pointer()) + __rseq_offset);
+		// Negative while registration is pending or has failed
+		const std::int32_t cpu = static_cast<std::int32_t>(
+			__atomic_load_n(&area->cpu_id, __ATOMIC_RELAXED));
+		if (cpu >= 0) return static_cast<unsigned>(cpu);
+	}
+#endif
+	static thread_local const unsigned stripe =
+		nextStripe.fetch_add(1, std::memory_order_relaxed);
+	return stripe;
+}
+
+// Every CPU the system may bring online, so that CPU numbers map one to one
+std::size_t CpuCount() noexcept
+{
+#if defined(__unix__) || defined(__APPLE__)
+	const long configured = ::sysconf(_SC_NPROCESSORS_CONF);
+	if (configured > 0) return static_cast<std::size_t>(configured);
+#endif
+	const unsigned hardware = std::thread::hardware_concurrency();
+	return hardware ? hardware : 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// CreateCpuHeaps
+// Registers one heap per CPU in PoolAllocator, runs once
+////////////////////////////////////////////////////////////////////////////////
+
+const std::vector<SmallObjAllocator*>& CreateCpuHeaps()
+{
+	HeapRegistry& registry = PoolAllocator::GetInstance();
+	std::unique_lock<std::shared_mutex> lock(registry.mutex);
+	const std::size_t count = CpuCount();
+	registry.cpuHeaps.reserve(count);
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		registry.heaps.emplace_back();
+		registry.cpuHeaps.push_back(&registry.heaps.back());
+	}
+	return registry.cpuHeaps;
+}
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SmallObjAllocator::Lock (internal)
+// Waits for the thread holding the heap, which was preempted or migrated
+//     while inside
+////////////////////////////////////////////////////////////////////////////////
+
+void SmallObjAllocator::Lock() noexcept
+{
+	for (unsigned spins = 0; !TryLock(); ++spins)
+	{
+		if (spins >= 64) std::this_thread::yield();
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ThreadHeap::LockCpuHeap (internal)
+// Locks the heap of the current CPU, or the first free one after it when
+//     another thread holds it
+////////////////////////////////////////////////////////////////////////////////
+
+SmallObjAllocator* ThreadHeap::LockCpuHeap()
+{
+	static const std::vector<SmallObjAllocator*>& heaps = CreateCpuHeaps();
+	const std::size_t count = heaps.size();
+	const std::size_t first = CurrentCpu() % count;
+
+	std::size_t i = first;
+	do
+	{
+		if (heaps[i]->TryLock()) return heaps[i];
+		if (++i == count) i = 0;
+	} while (i != first);
+
+	heaps[first]->Lock();
+	return heaps[first];
+}
+
+#endif
+
+#ifdef SOALLOC_STATS
+
+////////////////////////////////////////////////////////////////////////////////
+// FixedAllocator::CollectStats
+// Adds the counters of this allocator to 'stats'
+// May be called from any thread, the result is a consistent snapshot only
+//     while the owning thread is idle
+////////////////////////////////////////////////////////////////////////////////
+
+void FixedAllocator::CollectStats(SizeClassStats& stats) const
+{
+	const std::uint64_t allocations = allocations_.Get();
+	const std::uint64_t deallocations = deallocations_.Get();
+	const std::uint64_t live =
+		allocations > deallocations ? allocations - deallocations : 0;
+	const std::uint64_t chunks = chunkCount_.Get();
+
+	stats.blockSize = blockSize_;
+	stats.allocations += allocations;
+	stats.deallocations += deallocations;
+	stats.liveBlocks += live;
+	stats.highWater += highWater_.Get();
+	stats.chunks += chunks;
+	stats.emptyChunks += emptyChunks_.Get();
+	stats.refills += refills_.Get();
+	stats.reuses += reuses_.Get();
+	stats.transfers += transfers_.Get();
+	stats.releases += releases_.Get();
+	stats.decays += decays_.Get();
+	stats.bytesReserved += chunks * chunkLength_;
+	stats.bytesInUse += live * blockSize_;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// SmallObjAllocator::CollectStats
+// Adds the counters of this heap to 'stats'
+////////////////////////////////////////////////////////////////////////////////
+
+void SmallObjAllocator::CollectStats(AllocatorStats& stats) const
+{
+	const std::size_t numClasses = SizeClassOf(maxObjectSize_) + 1;
+	if (stats.classes.size() < numClasses) stats.classes.resize(numClasses);
+
+	++stats.heaps;
+	stats.largeAllocations += largeAllocations_.Get();
+	stats.largeDeallocations += largeDeallocations_.Get();
+	for (std::size_t i = 0; i < numClasses; ++i)
+		pool_[i].CollectStats(stats.classes[i]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ThreadHeap::CollectStats
+// Adds the counters of every heap registered in PoolAllocator to 'stats'
+////////////////////////////////////////////////////////////////////////////////
+
+void ThreadHeap::CollectStats(AllocatorStats& stats)
+{
+	HeapRegistry& registry = PoolAllocator::GetInstance();
+	std::shared_lock<std::shared_mutex> lock(registry.mutex);
+	for (const SmallObjAllocator& heap: registry.heaps)
+		heap.CollectStats(stats);
+	stats.orphanedHeaps += registry.orphans.size();
+	stats.transferCacheBytes += FixedAllocator::TransferCacheBytes();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// AllocatorStats::Dump
+// Writes one line per size class that was ever used and a total
+////////////////////////////////////////////////////////////////////////////////
+
+void AllocatorStats::Dump(std::ostream& out) const
+{
+	static const char* const columns[] = { "size", "allocs", "frees", "live",
+		"peak", "chunks", "empty", "refills", "reuses", "transfers", "releases",
+		"decays", "reserved", "in use" };
+
+	out << "heaps: " << heaps << " (" << orphanedHeaps << " orphaned)"
+		<< ", large allocs: " << largeAllocations
+		<< ", large frees: " << largeDeallocations
+		<< ", transfer cache: " << transferCacheBytes << " bytes\n";
+	for (const char* column: columns)
+		out << std::setw(11) << column;
+	out << '\n';
+
+	SizeClassStats total;
+	for (const SizeClassStats& s: classes)
+	{
+		if (s.allocations == 0 && s.chunks == 0) continue;
+		out << std::setw(11) << s.blockSize << std::setw(11) << s.allocations
+			<< std::setw(11) << s.deallocations << std::setw(11) << s.liveBlocks
+			<< std::setw(11) << s.highWater << std::setw(11) << s.chunks
+			<< std::setw(11) << s.emptyChunks << std::setw(11) << s.refills
+			<< std::setw(11) << s.reuses << std::setw(11) << s.transfers
+			<< std::setw(11) << s.releases
+			<< std::setw(11) << s.decays << std::setw(11) << s.bytesReserved
+			<< std::setw(11) << s.bytesInUse << '\n';
+		total.allocations += s.allocations;
+		total.deallocations += s.deallocations;
+		total.liveBlocks += s.liveBlocks;
+		total.chunks += s.chunks;
+		total.emptyChunks += s.emptyChunks;
+		total.refills += s.refills;
+		total.reuses += s.reuses;
+		total.transfers += s.transfers;
+		total.releases += s.releases;
+		total.decays += s.decays;
+		total.bytesReserved += s.bytesReserved;
+		total.bytesInUse += s.bytesInUse;
+	}
+	out << std::setw(11) << "total" << std::setw(11) << total.allocations
+		<< std::setw(11) << total.deallocations << std::setw(11) << total.liveBlocks
+		<< std::setw(11) << "" << std::setw(11) << total.chunks
+		<< std::setw(11) << total.emptyChunks << std::setw(11) << total.refills
+		<< std::setw(11) << total.reuses << std::setw(11) << total.transfers
+		<< std::setw(11) << total.releases
+		<< std::setw(11) << total.decays << std::setw(11) << total.bytesReserved
+		<< std::setw(11) << total.bytesInUse << '\n';
+}
+
+#endif
+
+#ifdef SOALLOC_TRACE
+
+namespace
+{
+
+const std::size_t TRACE_BUFFER_EVENTS = 4096;
+
+std::mutex traceMutex;
+std::FILE* traceFile = nullptr;
+bool traceFailed = false;
+std::atomic<std::uint16_t> traceThreads{ 0 };
+
+// Events of one thread not written yet
+struct TraceBuffer
+{
+	std::unique_ptr<TraceEvent[]> events;
+	std::size_t count = 0;
+	std::uint16_t thread = 0;
+	// Set while the buffer allocates or writes, the allocations this makes
+	// are not recorded
+	bool busy = false;
+
+	~TraceBuffer()
+	{
+		Write();
+	}
+
+	void Write() noexcept;
+};
+
+thread_local TraceBuffer traceBuffer;
+
+////////////////////////////////////////////////////////////////////////////////
+// TraceBuffer::Write
+// Appends the buffered events to the trace file, creating it on first use
+////////////////////////////////////////////////////////////////////////////////
+
+void TraceBuffer::Write() noexcept
+{
+	if (count == 0 || busy) return;
+
+	busy = true;
+	{
+		std::lock_guard<std::mutex> lock(traceMutex);
+		if (traceFile == nullptr && !traceFailed)
+		{
+			const char* name = std::getenv("SOALLOC_TRACE_FILE");
+			traceFile = std::fopen(name ? name : "soalloc.trace", "wb");
+			TraceHeader header;
+			std::copy(TRACE_MAGIC, TRACE_MAGIC + sizeof(header.magic), header.magic);
+			header.version = TRACE_VERSION;
+			header.eventSize = sizeof(TraceEvent);
+			if (traceFile == nullptr ||
+				std::fwrite(&header, sizeof(header), 1, traceFile) != 1)
+				traceFailed = true;
+		}
+		if (!traceFailed)
+		{
+			std::fwrite(events.get(), sizeof(TraceEvent), count, traceFile);
+			std::fflush(traceFile);
+		}
+	}
+	count = 0;
+	busy = false;
+}
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// TraceRecorder::Record
+// Appends an event to the buffer of the calling thread
+////////////////////////////////////////////////////////////////////////////////
+
+void TraceRecorder::Record(TraceOp op, const void* p, std::size_t size,
+	std::size_t alignment) noexcept
+{
+	static const std::chrono::steady_clock::time_point start =
+		std::chrono::steady_clock::now();
+
+	TraceBuffer& buffer = traceBuffer;
+	if (buffer.busy || p == nullptr) return;
+	if (!buffer.events)
+	{
+		buffer.busy = true;
+		buffer.events.reset(new (std::nothrow) TraceEvent[TRACE_BUFFER_EVENTS]);
+		buffer.thread = traceThreads.fetch_add(1, std::memory_order_relaxed);
+		buffer.busy = false;
+		if (!buffer.events) return;
+	}
+
+	std::uint8_t shift = 0;
+	while ((std::size_t(1) << shift) < alignment) ++shift;
+
+	TraceEvent& event = buffer.events[buffer.count];
+	event.time = static_cast<std::uint64_t>(
+		std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - start).count());
+	event.object = reinterpret_cast<std::uintptr_t>(p);
+	event.size = static_cast<std::uint32_t>(
+		size < UINT32_MAX ? size : UINT32_MAX);
+	event.thread = buffer.thread;
+	event.op = op;
+	event.alignmentShift = shift;
+	if (++buffer.count == TRACE_BUFFER_EVENTS) buffer.Write();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// TraceRecorder::Flush
+////////////////////////////////////////////////////////////////////////////////
+
+void TraceRecorder::Flush() noexcept
+{
+	traceBuffer.Write();
+}
+
+#endif
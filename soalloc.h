@@ -6,30 +6,418 @@
 	Applied". Copyright (c) 2001. Addison-Wesley.
 	+ small performance improvements and bug fixes
 
-	Multithreaded work has limitations: 
-	1 - deleting an object should be performed from the same thread
+	Multithreaded work:
+	1 - every thread allocates from its own heap; an object deleted by
+	    another thread is queued back to the heap it came from and reclaimed
+	    by its owner on the owner's next allocation or deallocation
 	2 - you cannot delete the same object twice
+	3 - when a thread exits, its empty chunks are released and its heap,
+	    with any blocks still in use, is adopted by the next new thread
+	With SOALLOC_PER_CPU the heaps belong to CPUs instead of threads: a
+	thread uses the heap of the CPU it runs on, found through rseq, and
+	holds its lock for the length of a call
+
+	Objects carry no size header: the size of a block is found from its
+	address, so classes derived from a soalloc<T> class are pooled too
+
+	Blocks are aligned to 16 bytes, and to alignof(T) up to a cache line;
+	soalloc_isolated<T> keeps every object on cache lines of its own
+
+	Objects of soalloc_regional<T> classes created while a soalloc_region
+	is alive are freed all at once with the region
 
 *******************************************************************************/
 
 #pragma once
 
 #include <cstdlib>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <iosfwd>
+#include <type_traits>
+#include <new>
+#include <memory>
 #include <vector>
 #include <map>
+#include <list>
 #include <thread>
 #include <mutex>
 #include <shared_mutex>
+#include <limits>
+
+#if defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define SOALLOC_HAS_MEMORY_RESOURCE
+#endif
+#endif
 
 
 #ifndef DEFAULT_CHUNK_SIZE
-#define DEFAULT_CHUNK_SIZE 4096
+#define DEFAULT_CHUNK_SIZE 65536
+#endif
+
+#ifndef MAX_CHUNK_SIZE
+#define MAX_CHUNK_SIZE (2 * 1024 * 1024)
 #endif
 
 #ifndef MAX_SMALL_OBJECT_SIZE
 #define MAX_SMALL_OBJECT_SIZE 256
 #endif
 
+#ifndef SOALLOC_PAGE_SHIFT
+#define SOALLOC_PAGE_SHIFT 12
+#endif
+
+#define SOALLOC_PAGE_SIZE (std::size_t(1) << SOALLOC_PAGE_SHIFT)
+
+#ifndef SOALLOC_CACHE_LINE_SIZE
+#define SOALLOC_CACHE_LINE_SIZE 64
+#endif
+
+#ifndef SOALLOC_MAX_EMPTY_CHUNKS
+#define SOALLOC_MAX_EMPTY_CHUNKS 4
+#endif
+
+#ifndef SOALLOC_MAX_EMPTY_BYTES
+#define SOALLOC_MAX_EMPTY_BYTES (1024 * 1024)
+#endif
+
+#ifndef SOALLOC_DECAY_OPERATIONS
+#define SOALLOC_DECAY_OPERATIONS 65536
+#endif
+
+#ifndef SOALLOC_DECAY_MILLISECONDS
+#define SOALLOC_DECAY_MILLISECONDS 0
+#endif
+
+#ifndef SOALLOC_TRANSFER_CACHE_BYTES
+#define SOALLOC_TRANSFER_CACHE_BYTES (1024 * 1024)
+#endif
+
+class SmallObjAllocator;
+
+////////////////////////////////////////////////////////////////////////////////
+// class PageMap
+// Maps every page of a chunk to the chunk itself, so that the chunk owning
+//     any block is found in constant time. Lookups never lock
+////////////////////////////////////////////////////////////////////////////////
+
+class PageMap
+{
+	static const unsigned ADDRESS_BITS = sizeof(void*) == 8 ? 48 : 32;
+	static const unsigned PAGE_BITS = ADDRESS_BITS - SOALLOC_PAGE_SHIFT;
+	static const unsigned LEAF_BITS = PAGE_BITS / 3;
+	static const unsigned MID_BITS = PAGE_BITS / 3;
+	static const unsigned ROOT_BITS = PAGE_BITS - MID_BITS - LEAF_BITS;
+
+	struct Leaf
+	{
+		std::atomic<void*> pages[std::size_t(1) << LEAF_BITS];
+	};
+	struct Mid
+	{
+		std::atomic<Leaf*> leaves[std::size_t(1) << MID_BITS];
+	};
+
+	static std::atomic<Mid*> root_[std::size_t(1) << ROOT_BITS];
+	static std::mutex mutex_;
+
+public:
+	// nullptr for addresses the map does not cover
+	static void* Find(const void* p) noexcept;
+	static void Assign(const void* p, std::size_t length, void* value);
+	static bool Covers(const void* p, std::size_t length) noexcept;
+
+	// Hold the map locked across fork, see ThreadHeap::PrepareFork
+	static void PrepareFork() noexcept;
+	static void AfterFork() noexcept;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// class PageProvider
+// Source of the page aligned memory that chunks are made of
+////////////////////////////////////////////////////////////////////////////////
+
+class PageProvider
+{
+public:
+	virtual ~PageProvider() = default;
+
+	// Returns 'length' bytes aligned to SOALLOC_PAGE_SIZE, throws on failure
+	virtual void* Allocate(std::size_t length) = 0;
+	virtual void Deallocate(void* p, std::size_t length) noexcept = 0;
+	// Gives the system the pages of deallocated memory the provider still
+	// holds, returns their bytes
+	virtual std::size_t Trim() noexcept
+	{
+		return 0;
+	}
+	// Hold the provider locked across fork, see ThreadHeap::PrepareFork
+	virtual void PrepareFork() noexcept
+	{
+	}
+	virtual void AfterFork() noexcept
+	{
+	}
+
+	// The provider used by heaps that were not given one, never destroyed
+	static PageProvider& Default();
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// class NewPageProvider
+// Takes chunks from the global aligned operator new
+////////////////////////////////////////////////////////////////////////////////
+
+class NewPageProvider : public PageProvider
+{
+public:
+	void* Allocate(std::size_t length) override;
+	void Deallocate(void* p, std::size_t length) noexcept override;
+};
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#ifndef SOALLOC_RESERVE_SIZE
+#define SOALLOC_RESERVE_SIZE (std::size_t(256) << 20)
+#endif
+
+#ifndef SOALLOC_HUGE_PAGE_SIZE
+#define SOALLOC_HUGE_PAGE_SIZE (std::size_t(2) << 20)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// class MmapPageProvider
+// Carves chunks out of large virtual ranges reserved with mmap, optionally
+//     backed by huge pages. Released chunks keep their address range for
+//     reuse but give their physical pages back with madvise
+////////////////////////////////////////////////////////////////////////////////
+
+class MmapPageProvider : public PageProvider
+{
+public:
+	enum HugePages
+	{
+		NO_HUGE_PAGES,
+		TRANSPARENT_HUGE_PAGES,	// madvise(MADV_HUGEPAGE) on every range
+		HUGETLB_PAGES			// MAP_HUGETLB, transparent ones if it fails
+	};
+	enum Purge
+	{
+		PURGE_DONTNEED,			// pages are dropped at once
+		PURGE_FREE				// MADV_FREE, the kernel drops them lazily
+	};
+
+	explicit MmapPageProvider(
+		HugePages hugePages = NO_HUGE_PAGES,
+		Purge purge = PURGE_DONTNEED,
+		std::size_t reserveSize = SOALLOC_RESERVE_SIZE);
+	~MmapPageProvider();
+
+	void* Allocate(std::size_t length) override;
+	void Deallocate(void* p, std::size_t length) noexcept override;
+	// Drops the pages PURGE_FREE left to the kernel
+	std::size_t Trim() noexcept override;
+	void PrepareFork() noexcept override;
+	void AfterFork() noexcept override;
+
+private:
+	MmapPageProvider(const MmapPageProvider&) = delete;
+	MmapPageProvider& operator=(const MmapPageProvider&) = delete;
+
+	void Reserve(std::size_t length);
+	// Returns false when the pages are only marked free
+	bool PurgePages(void* p, std::size_t length) noexcept;
+
+	HugePages hugePages_;
+	Purge purge_;
+	std::size_t reserveSize_;
+	std::mutex mutex_;
+	std::vector<std::pair<char*, std::size_t>> ranges_;
+	char* next_;
+	char* end_;
+	// Released chunks by length
+	std::map<std::size_t, std::vector<void*>> free_;
+	// Released chunks whose pages the kernel may still hold, reused first
+	std::map<std::size_t, std::vector<void*>> lazy_;
+};
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Size classes
+// 16 byte steps up to 128 bytes and four geometric steps per doubling above
+//     that. Every class is a multiple of 16, and a size rounded up to any
+//     power of two falls in a class that is a multiple of that power too
+////////////////////////////////////////////////////////////////////////////////
+
+constexpr std::size_t SizeClassOf(std::size_t size)
+{
+	if (size <= 128) return size ? (size - 1) >> 4 : 0;
+
+	std::size_t level = 7;
+	while ((std::size_t(2) << level) < size) ++level;
+	const std::size_t step = std::size_t(1) << (level - 2);
+	return 8 + (level - 7) * 4 + ((size - (std::size_t(1) << level) - 1) / step);
+}
+
+constexpr std::size_t SizeOfClass(std::size_t sizeClass)
+{
+	if (sizeClass < 8) return (sizeClass + 1) << 4;
+
+	const std::size_t level = 7 + (sizeClass - 8) / 4;
+	return (std::size_t(1) << level) +
+		((sizeClass - 8) % 4 + 1) * (std::size_t(1) << (level - 2));
+}
+
+#ifdef SOALLOC_STATS
+
+////////////////////////////////////////////////////////////////////////////////
+// Statistics, compiled in only with SOALLOC_STATS
+// Counters are written by the thread owning the heap and may be read by any
+//     thread, so they need no read-modify-write
+////////////////////////////////////////////////////////////////////////////////
+
+class StatCounter
+{
+	std::atomic<std::uint64_t> value_{ 0 };
+
+public:
+	void Add(std::uint64_t n = 1) noexcept
+	{
+		value_.store(value_.load(std::memory_order_relaxed) + n,
+			std::memory_order_relaxed);
+	}
+	void Sub(std::uint64_t n = 1) noexcept
+	{
+		value_.store(value_.load(std::memory_order_relaxed) - n,
+			std::memory_order_relaxed);
+	}
+	void Max(std::uint64_t n) noexcept
+	{
+		if (n > value_.load(std::memory_order_relaxed))
+			value_.store(n, std::memory_order_relaxed);
+	}
+	std::uint64_t Get() const noexcept
+	{
+		return value_.load(std::memory_order_relaxed);
+	}
+};
+
+// Counters of one size class, summed over heaps when aggregated
+// (the high-water mark is then the sum of the per-heap marks)
+struct SizeClassStats
+{
+	std::size_t blockSize = 0;
+	std::uint64_t allocations = 0;
+	std::uint64_t deallocations = 0;
+	std::uint64_t liveBlocks = 0;
+	std::uint64_t highWater = 0;
+	std::uint64_t chunks = 0;
+	std::uint64_t emptyChunks = 0;
+	std::uint64_t refills = 0;		// allocations that had to look for a chunk
+	std::uint64_t reuses = 0;		// refills served by a kept free chunk
+	std::uint64_t transfers = 0;	// refills served by the transfer cache
+	std::uint64_t releases = 0;		// chunks given back to the page provider
+	std::uint64_t decays = 0;		// releases of chunks left unused too long
+	std::uint64_t bytesReserved = 0;
+	std::uint64_t bytesInUse = 0;
+};
+
+struct AllocatorStats
+{
+	std::size_t heaps = 0;
+	std::size_t orphanedHeaps = 0;
+	// Objects above the maximum small object size, served by operator new
+	std::uint64_t largeAllocations = 0;
+	std::uint64_t largeDeallocations = 0;
+	// Free chunks no heap holds, see FixedAllocator::TransferCacheBytes
+	std::uint64_t transferCacheBytes = 0;
+	// Indexed by size class
+	std::vector<SizeClassStats> classes;
+
+	// Writes a table of the size classes that were ever used
+	void Dump(std::ostream& out) const;
+};
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Allocation traces
+// A trace file is a TraceHeader followed by TraceEvents in native byte order.
+//     Every thread writes its own events in order, in runs that interleave
+//     with the runs of other threads
+////////////////////////////////////////////////////////////////////////////////
+
+enum class TraceOp : std::uint8_t
+{
+	Allocate,
+	Deallocate
+};
+
+struct TraceHeader
+{
+	char magic[8];			// "soatrace"
+	std::uint32_t version;
+	std::uint32_t eventSize;
+};
+
+const char TRACE_MAGIC[8] = { 's', 'o', 'a', 't', 'r', 'a', 'c', 'e' };
+const std::uint32_t TRACE_VERSION = 1;
+
+struct TraceEvent
+{
+	std::uint64_t time;			// nanoseconds since the first event
+	std::uint64_t object;		// address of the block, reused once it is freed
+	std::uint32_t size;			// bytes asked for, 0 when freed without a size
+	std::uint16_t thread;		// numbered in the order of their first event
+	TraceOp op;
+	std::uint8_t alignmentShift;
+};
+
+#ifdef SOALLOC_TRACE
+
+////////////////////////////////////////////////////////////////////////////////
+// class TraceRecorder
+// Records every allocation and deallocation of a SmallObjAllocator, compiled
+//     in only with SOALLOC_TRACE
+// Every thread appends to a buffer of its own without locking; a full buffer
+//     is written to the file named by the SOALLOC_TRACE_FILE environment
+//     variable, soalloc.trace by default, and so is the rest when the thread
+//     exits
+////////////////////////////////////////////////////////////////////////////////
+
+class TraceRecorder
+{
+public:
+	static void Record(TraceOp op, const void* p, std::size_t size,
+		std::size_t alignment) noexcept;
+	// Writes the events of the calling thread recorded so far
+	static void Flush() noexcept;
+};
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// struct RetentionPolicy
+// How many completely free chunks every size class of a heap keeps for reuse,
+//     and for how long
+// A decay period ends after 'decayOperations' deallocations made while free
+//     chunks are kept, or after 'decayTime', whichever comes first; 0 turns
+//     either off. Half of the chunks left unused for a whole period are then
+//     released, oldest first
+////////////////////////////////////////////////////////////////////////////////
+
+struct RetentionPolicy
+{
+	std::size_t maxEmptyChunks = SOALLOC_MAX_EMPTY_CHUNKS;
+	std::size_t maxEmptyBytes = SOALLOC_MAX_EMPTY_BYTES;
+	std::uint64_t decayOperations = SOALLOC_DECAY_OPERATIONS;
+	std::chrono::milliseconds decayTime{ SOALLOC_DECAY_MILLISECONDS };
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 // class FixedAllocator
 // Offers services for allocating fixed-sized objects
@@ -37,82 +425,279 @@
 
 class FixedAllocator
 {
+	// Index of a block inside a chunk, wide enough for the smallest blocks
+	// of the largest chunk
+	typedef std::conditional<(MAX_CHUNK_SIZE / 16 <= 0xFFFF),
+		std::uint16_t, std::uint32_t>::type BlockIndex;
+
+	struct Chunk;
+
+	// Intrusive doubly linked list of chunks, threaded through their headers
+	struct ChunkList
+	{
+		Chunk* m_first = nullptr;
+
+		void PushFront(Chunk* chunk);
+		void Remove(Chunk* chunk);
+	};
+
+	// The chunk header lives at the start of its own page aligned memory,
+	// the blocks follow it. Blocks from m_firstUntouchedBlock on were never
+	// handed out and are carved off in order; the free list holds only freed
+	// blocks and ends with the index of the first untouched one
 	struct Chunk
 	{
-		void Init(std::size_t blockSize, unsigned char blocks);
+		static Chunk* Create(std::size_t length, std::size_t blockSize,
+			BlockIndex blocks, FixedAllocator* owner);
 
 		void* Allocate(std::size_t blockSize);
+		std::size_t Allocate(std::size_t blockSize, std::size_t n, void** out);
 
 		void Deallocate(void* p, std::size_t blockSize);
 
 
-		void Reset(std::size_t blockSize, unsigned char blocks);
+		void Reset(std::size_t blockSize, BlockIndex blocks);
 
-		void Release();
+		void Release(std::size_t length);
 		unsigned char* m_pData;
-		unsigned char m_firstAvailableBlock;
-		unsigned char m_blocksAvailable;
+		FixedAllocator* m_owner;
+		// The list holding the chunk, nullptr for allocChunk_
+		ChunkList* m_list;
+		Chunk* m_prev;
+		Chunk* m_next;
+		// A free chunk left unused since the last decay period ended
+		bool m_idle;
+		BlockIndex m_firstAvailableBlock;
+		BlockIndex m_firstUntouchedBlock;
+		BlockIndex m_blocksAvailable;
 	};
-	void DoDeallocate(void* p);
-	Chunk* VicinityFind(void* p);
+	static const std::size_t CHUNK_HEADER_SIZE;
+
+	// The clock is read at most this often when decay is time based
+	static const std::uint64_t DECAY_CLOCK_INTERVAL = 1024;
+
+	// Free chunks shared by all heaps, see the definition
+	struct TransferCache;
+
+	void FindChunk();
+	// Return the bytes released to the page provider
+	std::size_t DoDeallocate(Chunk* chunk, void* p);
+	void ScheduleDecay();
+	std::size_t Decay();
+	// A free chunk the retention policy does not keep goes to the transfer
+	// cache, or back to the page provider if the cache is full
+	std::size_t Discard(Chunk* chunk);
+	Chunk* TakeTransferred();
 
 	std::size_t blockSize_;
-	unsigned char numBlocks_;
-	typedef std::vector<Chunk> Chunks;
-	Chunks chunks_;
+	std::size_t chunkLength_;
+	BlockIndex numBlocks_;
+	// Every chunk but allocChunk_ is on the list matching its free blocks
+	ChunkList partialChunks_;
+	ChunkList fullChunks_;
+	ChunkList freeChunks_;
 	Chunk* allocChunk_;
-	Chunk* deallocChunk_;
-	mutable const FixedAllocator* prev_;
-	mutable const FixedAllocator* next_;
+	SmallObjAllocator* heap_;
+	PageProvider* provider_;
+
+	RetentionPolicy retention_;
+	std::size_t maxFreeChunks_;
+	std::size_t freeChunkCount_;
+	// Deallocations made while free chunks are kept, they drive the decay
+	std::uint64_t ticks_;
+	std::uint64_t nextDecay_;
+	std::uint64_t periodTicks_;
+	std::chrono::steady_clock::time_point periodStart_;
+
+#ifdef SOALLOC_STATS
+	StatCounter allocations_;
+	StatCounter deallocations_;
+	StatCounter highWater_;
+	StatCounter chunkCount_;
+	StatCounter emptyChunks_;
+	StatCounter refills_;
+	StatCounter reuses_;
+	StatCounter transfers_;
+	StatCounter releases_;
+	StatCounter decays_;
+#endif
+
+	FixedAllocator(const FixedAllocator&) = delete;
+	FixedAllocator& operator=(const FixedAllocator&) = delete;
 
 public:
-	explicit FixedAllocator(std::size_t blockSize = 0);
-	FixedAllocator(const FixedAllocator&);
-	FixedAllocator& operator=(const FixedAllocator&);
+	FixedAllocator();
 	~FixedAllocator();
 
-	void Swap(FixedAllocator& rhs);
+	void Initialize(std::size_t blockSize, std::size_t chunkSize,
+		SmallObjAllocator* heap, PageProvider* provider,
+		const RetentionPolicy& retention);
+	// Releases the free chunks the new policy does not keep
+	void SetRetention(const RetentionPolicy& retention);
 
 	void* Allocate();
-	void Deallocate(void* p);
+	// Returns the bytes released to the page provider
+	std::size_t Deallocate(void* p);
+	void AllocateBatch(std::size_t n, void** out);
+	// Stops at the first block of another allocator, returns the blocks done
+	std::size_t DeallocateBatch(void** p, std::size_t n);
+	// Returns the bytes released
+	std::size_t ReleaseEmptyChunks();
 	std::size_t BlockSize() const
 	{
 		return blockSize_;
 	}
-	bool operator<(std::size_t rhs) const
+	SmallObjAllocator* Heap() const
 	{
-		return BlockSize() < rhs;
+		return heap_;
 	}
+
+	// Returns the allocator whose chunk holds the block 'p', nullptr if none
+	static FixedAllocator* OwnerOf(const void* p) noexcept;
+
+	// A chunk lent out no longer belongs to the allocator: its blocks have no
+	// owner until it is returned
+	void* LendChunk(std::size_t& length);
+	void ReturnChunk(void* data);
+	static bool IsLent(const void* p) noexcept;
+
+	// Bytes of the free chunks waiting in the transfer cache
+	static std::size_t TransferCacheBytes() noexcept;
+	// Gives every chunk in the transfer cache back to its page provider,
+	// returns the bytes released
+	static std::size_t ReleaseTransferCache() noexcept;
+	// Hold every stack of the transfer cache locked across fork, see
+	// ThreadHeap::PrepareFork
+	static void PrepareFork() noexcept;
+	static void AfterFork() noexcept;
+
+#ifdef SOALLOC_STATS
+	// Adds the counters of this allocator to 'stats'
+	void CollectStats(SizeClassStats& stats) const;
+#endif
 };
 
 ////////////////////////////////////////////////////////////////////////////////
 // class SmallObjAllocator
 // Offers services for allocating small-sized objects
+// Aligned to a cache line so that heaps of different threads never share one
 ////////////////////////////////////////////////////////////////////////////////
 
-class SmallObjAllocator
+class alignas(SOALLOC_CACHE_LINE_SIZE) SmallObjAllocator
 {
 public:
 	SmallObjAllocator(
 		std::size_t chunkSize = DEFAULT_CHUNK_SIZE,
-		std::size_t maxObjectSize = MAX_SMALL_OBJECT_SIZE);
+		std::size_t maxObjectSize = MAX_SMALL_OBJECT_SIZE,
+		PageProvider* provider = nullptr,
+		const RetentionPolicy& retention = RetentionPolicy());
+	~SmallObjAllocator();
+
+	// Every block is aligned to at least this
+	static constexpr std::size_t BLOCK_ALIGNMENT = 16;
+	// Chunk data is aligned to this, stricter alignments are not pooled
+	static constexpr std::size_t MAX_BLOCK_ALIGNMENT = SOALLOC_CACHE_LINE_SIZE;
 
 	void* Allocate(std::size_t numBytes);
 	void Deallocate(void* p, std::size_t size);
+	// Finds the size of 'p' itself
+	void Deallocate(void* p);
+
+	// 'alignment' is a power of two, the size is rounded up to it
+	// Deallocate accepts 0 for a size that is not known
+	void* Allocate(std::size_t numBytes, std::size_t alignment);
+	void Deallocate(void* p, std::size_t numBytes, std::size_t alignment);
+
+	// Allocates a block of 'sizeClass', for callers that found it at compile
+	// time with SizeClassOf; the block is freed by any size of the class
+	// Not traced, the request it was made for is not known
+	void* AllocateClass(std::size_t sizeClass)
+	{
+		if (remoteFrees_.load(std::memory_order_relaxed)) DrainRemoteFrees();
+		return pool_[sizeClass].Allocate();
+	}
+
+	// 'n' objects of the same size at once, cheaper than one by one
+	void AllocateBatch(std::size_t numBytes, std::size_t n, void** out,
+		std::size_t alignment = BLOCK_ALIGNMENT);
+	void DeallocateBatch(std::size_t numBytes, void** p, std::size_t n,
+		std::size_t alignment = BLOCK_ALIGNMENT);
+
+	// Takes back the blocks queued by other threads and gives every empty
+	// chunk back to the page provider, returns the bytes released
+	// Must be called by the owning thread
+	std::size_t ReleaseEmptyChunks();
+	// ReleaseEmptyChunks, then with 'purgePages' has the page provider give
+	// the system what it keeps, see PageProvider::Trim
+	// Must be called by the owning thread, ThreadHeap::Trim by any
+	std::size_t Trim(bool purgePages = true);
+	// Applies to every size class, must be called by the owning thread
+	void SetRetention(const RetentionPolicy& retention);
+
+#ifdef SOALLOC_STATS
+	// Adds the counters of this heap to 'stats'
+	void CollectStats(AllocatorStats& stats) const;
+#endif
 
 private:
+	friend class soalloc_region;
+	friend class ThreadHeap;
+
 	SmallObjAllocator(const SmallObjAllocator&);
 	SmallObjAllocator& operator=(const SmallObjAllocator&);
 
-	typedef std::vector<FixedAllocator> Pool;
-	Pool pool_;
-	FixedAllocator* pLastAlloc_;
-	FixedAllocator* pLastDealloc_;
+	// Set in the remote free queue head, whose blocks are 16 byte aligned,
+	// to have the owner trim the heap when it next drains the queue
+	static const std::uintptr_t TRIM_REQUEST = 1;
+
+	void PushRemoteFree(void* p) noexcept;
+	// Returns the bytes released
+	std::size_t DrainRemoteFrees();
+	void RequestTrim() noexcept;
+	// Deallocate without tracing
+	void DeallocateBlock(void* p);
+	// Whole chunks of the largest size class for a soalloc_region
+	void* LendChunk(std::size_t& length);
+	void ReturnChunk(void* data);
+
+	// One FixedAllocator per size class, all created with the heap
+	std::unique_ptr<FixedAllocator[]> pool_;
+	// Size class of every request, indexed by (numBytes + 15) >> 4
+	std::vector<unsigned char> sizeClasses_;
 	std::size_t chunkSize_;
 	std::size_t maxObjectSize_;
+	PageProvider* provider_;
+
+#ifdef SOALLOC_STATS
+	StatCounter largeAllocations_;
+	StatCounter largeDeallocations_;
+#endif
+
+	// Blocks freed by other threads, linked through their first word
+	// Kept on its own cache line, foreign threads write it
+	alignas(SOALLOC_CACHE_LINE_SIZE) std::atomic<void*> remoteFrees_;
+
+#ifdef SOALLOC_PER_CPU
+	// Held by the thread using the heap, see ThreadHeap
+	std::atomic<bool> locked_{ false };
+
+	bool TryLock() noexcept
+	{
+		return !locked_.load(std::memory_order_relaxed) &&
+			!locked_.exchange(true, std::memory_order_acquire);
+	}
+	void Lock() noexcept;
+	void Unlock() noexcept
+	{
+		locked_.store(false, std::memory_order_release);
+	}
+#endif
 };
 
 // Singleton
+// The instance is never destroyed, as the page provider and the transfer
+//     cache are not, so that blocks can still be freed by static destructors
+//     that run after it would be, such as that of a global container
 template <typename T>
 class Singleton
 {
@@ -125,44 +710,575 @@ private:
 public:
 	static T& GetInstance() noexcept
 	{
-		static T s;
-		return s;
+		alignas(T) static unsigned char storage[sizeof(T)];
+		static T* s = ::new (storage) T;
+		return *s;
 	}
 };
 
-using SmallObjAllocatorMap = std::map<std::thread::id, SmallObjAllocator>;
-using PoolAllocator = Singleton<std::pair<SmallObjAllocatorMap,std::shared_mutex>>;
+// Every heap ever created, std::list keeps them in place
+using SmallObjAllocatorList = std::list<SmallObjAllocator>;
 
-template<typename T>
-class soalloc
+struct HeapRegistry
 {
-	static SmallObjAllocator* getSmallObjAllocator()
+	explicit HeapRegistry(
+		std::size_t chunkSize = DEFAULT_CHUNK_SIZE,
+		std::size_t maxObjectSize = MAX_SMALL_OBJECT_SIZE,
+		PageProvider* provider = nullptr)
+		: chunkSize(chunkSize), maxObjectSize(maxObjectSize), provider(provider)
+	{
+	}
+
+	// Adopts an orphaned heap or creates a new one
+	SmallObjAllocator* Adopt();
+	// Releases the empty chunks of 'heap' and leaves it to the next Adopt
+	void Orphan(SmallObjAllocator* heap) noexcept;
+
+	SmallObjAllocatorList heaps;
+	// Heaps of exited threads waiting for a new owner
+	std::vector<SmallObjAllocator*> orphans;
+	std::shared_mutex mutex;
+#ifdef SOALLOC_PER_CPU
+	// One heap per configured CPU, also listed in 'heaps'
+	std::vector<SmallObjAllocator*> cpuHeaps;
+#endif
+	// Configuration of the heaps created
+	const std::size_t chunkSize;
+	const std::size_t maxObjectSize;
+	PageProvider* const provider;
+};
+
+using PoolAllocator = Singleton<HeapRegistry>;
+
+////////////////////////////////////////////////////////////////////////////////
+// class PerThread
+// Binds the calling thread to a heap of Host::Registry(), adopting the heap
+//     of an exited thread if there is one. ThreadHeap is built on it, and so
+//     is an AllocatorSingleton of that threading model
+// The registry is locked once per thread, later calls read a thread_local
+// A thread allocating or freeing after its exit hook has run, from another
+//     thread_local destructor, gets a heap for that call only: its Ref
+//     orphans the heap again
+////////////////////////////////////////////////////////////////////////////////
+
+template <class Host>
+class PerThread
+{
+	// Hands the heap back to the registry when its thread exits
+	struct ExitHook
+	{
+		~ExitHook()
+		{
+			exited_ = true;
+			Detach();
+		}
+	};
+
+	static inline thread_local SmallObjAllocator* current_ = nullptr;
+	// Set once the exit hook has run, the thread then keeps no heap
+	static inline thread_local bool exited_ = false;
+
+	static SmallObjAllocator* Attach()
+	{
+		SmallObjAllocator* heap = Host::Registry().Adopt();
+		if (exited_) return heap;
+
+		current_ = heap;
+		static thread_local ExitHook hook;
+		(void)hook;
+		return heap;
+	}
+
+	static void Detach() noexcept
+	{
+		SmallObjAllocator* heap = current_;
+		if (heap == nullptr) return;
+		current_ = nullptr;
+		Host::Registry().Orphan(heap);
+	}
+
+public:
+	// The heap of the calling thread while the Ref lives
+	class Ref
 	{
-		SmallObjAllocator* pSmallObjAllocator = nullptr;
-		auto& map = PoolAllocator::GetInstance().first;
-		std::shared_mutex& mutex = PoolAllocator::GetInstance().second;
-		std::thread::id id = std::this_thread::get_id();
+		SmallObjAllocator* heap_;
+		// Taken by a thread past its exit hook, orphaned again with the Ref
+		bool orphan_;
+
+		Ref(const Ref&) = delete;
+		Ref& operator=(const Ref&) = delete;
+
+	public:
+		Ref()
+			: heap_(current_), orphan_(false)
+		{
+			if (heap_ == nullptr)
+			{
+				heap_ = Attach();
+				orphan_ = current_ == nullptr;
+			}
+		}
+		// 'heap' itself, one a Ref gave before
+		explicit Ref(SmallObjAllocator* heap) noexcept
+			: heap_(heap), orphan_(false)
+		{
+		}
+		~Ref()
+		{
+			if (orphan_) Host::Registry().Orphan(heap_);
+		}
+
+		SmallObjAllocator* operator->() const noexcept
 		{
-			std::shared_lock<std::shared_mutex> lock(mutex);
-			auto it = map.find(id);
-			if (it != map.end())
-				pSmallObjAllocator = &it->second;
+			return heap_;
 		}
-		if (!pSmallObjAllocator)
+		SmallObjAllocator* Heap() const noexcept
 		{
-			std::unique_lock<std::shared_mutex> lock(mutex);
-			pSmallObjAllocator = &map[id];
+			return heap_;
 		}
-		return pSmallObjAllocator;
+		// The thread's own heap may be kept, but not one taken past its exit
+		// hook
+		operator SmallObjAllocator*() const noexcept
+		{
+			return heap_;
+		}
+	};
+
+	// The heap of the calling thread, nullptr if it has none
+	static SmallObjAllocator* Current() noexcept
+	{
+		return current_;
 	}
+};
 
-	static void* alloc(size_t size, bool nothrow = false)
+////////////////////////////////////////////////////////////////////////////////
+// class ThreadHeap
+// Binds the calling thread to a SmallObjAllocator in PoolAllocator through
+//     PerThread
+// With SOALLOC_PER_CPU, Get returns the heap of the CPU the thread runs on
+//     instead, read from the rseq area glibc registers for every thread. The
+//     heap stays locked as long as the Ref lives; a thread finding it taken,
+//     preempted or moved to another CPU inside a call, tries the other heaps
+//     before waiting. Without rseq the threads are spread over the heaps in
+//     turn, as over striped locks
+////////////////////////////////////////////////////////////////////////////////
+
+class ThreadHeap
+{
+#ifdef SOALLOC_PER_CPU
+	static SmallObjAllocator* LockCpuHeap();
+#else
+	typedef PerThread<ThreadHeap> Threads;
+#endif
+
+	static inline thread_local bool inside_ = false;
+
+public:
+	// A heap the calling thread may use while the Ref lives
+	// Keep it for a single call: in per CPU mode it holds the heap locked
+#ifdef SOALLOC_PER_CPU
+	class Ref
+	{
+		SmallObjAllocator* heap_;
+
+		Ref(const Ref&) = delete;
+		Ref& operator=(const Ref&) = delete;
+
+	public:
+		explicit Ref(SmallObjAllocator* heap) noexcept
+			: heap_(heap)
+		{
+		}
+		~Ref()
+		{
+			heap_->Unlock();
+		}
+
+		SmallObjAllocator* operator->() const noexcept
+		{
+			return heap_;
+		}
+		SmallObjAllocator* Heap() const noexcept
+		{
+			return heap_;
+		}
+	};
+#else
+	typedef Threads::Ref Ref;
+#endif
+
+	static Ref Get()
+	{
+#ifdef SOALLOC_PER_CPU
+		return Ref(LockCpuHeap());
+#else
+		return Ref();
+#endif
+	}
+
+	// 'heap' itself, one Get returned before
+	static Ref Get(SmallObjAllocator* heap) noexcept
+	{
+#ifdef SOALLOC_PER_CPU
+		heap->Lock();
+#endif
+		return Ref(heap);
+	}
+
+	// Marks the calling thread as running inside soalloc, so that a global
+	// allocator built on it can serve the allocations soalloc makes for
+	// itself from somewhere else
+	class Scope
+	{
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+
+	public:
+		Scope() noexcept
+		{
+			inside_ = true;
+		}
+		~Scope()
+		{
+			inside_ = false;
+		}
+	};
+
+	static bool Inside() noexcept
+	{
+		return inside_;
+	}
+
+	// Largest object its heaps pool, as for an AllocatorSingleton
+	static constexpr std::size_t MAX_OBJECT_SIZE = MAX_SMALL_OBJECT_SIZE;
+
+	static HeapRegistry& Registry() noexcept
+	{
+		return PoolAllocator::GetInstance();
+	}
+
+	// Releases the empty chunks of every heap in PoolAllocator and of the
+	// transfer cache, and with 'purgePages' has the default page provider
+	// give the system what it keeps. Heaps of other live threads are trimmed
+	// by their owners on their next call, heaps of exited threads and, in
+	// per CPU mode, every heap at once. Returns the bytes released at once
+	// May be called from any thread
+	static std::size_t Trim(bool purgePages = true);
+
+	// Lock everything the heaps of PoolAllocator share before fork, and
+	// unlock it after, in the parent and in the child, so that the child
+	// finds no lock held by a thread it does not have. For pthread_atfork,
+	// the preload library registers them
+	static void PrepareFork() noexcept;
+	static void AfterFork() noexcept;
+
+#ifdef SOALLOC_STATS
+	// Adds the counters of every heap in PoolAllocator to 'stats'
+	static void CollectStats(AllocatorStats& stats);
+#endif
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Page sources of an AllocatorSingleton
+// Provider() is where its heaps take chunks from, never destroyed
+////////////////////////////////////////////////////////////////////////////////
+
+struct DefaultPageSource
+{
+	static PageProvider* Provider()
+	{
+		return &PageProvider::Default();
+	}
+};
+
+struct NewPageSource
+{
+	static PageProvider* Provider()
+	{
+		static PageProvider* provider = new NewPageProvider();
+		return provider;
+	}
+};
+
+#if defined(__unix__) || defined(__APPLE__)
+
+// One MmapPageProvider for every pool of the same configuration
+template <MmapPageProvider::HugePages hugePages = MmapPageProvider::NO_HUGE_PAGES,
+	MmapPageProvider::Purge purge = MmapPageProvider::PURGE_DONTNEED>
+struct MmapPageSource
+{
+	static PageProvider* Provider()
+	{
+		static PageProvider* provider = new MmapPageProvider(hugePages, purge);
+		return provider;
+	}
+};
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Threading models of an AllocatorSingleton
+// Each hands out a heap of 'Host' through a Ref held for a single call, and
+//     keeps its heaps in a Singleton of its own for every Host
+////////////////////////////////////////////////////////////////////////////////
+
+// One heap and no synchronisation: every block must be allocated and freed
+//     by the same thread
+template <class Host>
+class SingleThreaded
+{
+	struct Instance
+	{
+		SmallObjAllocator heap{ Host::CHUNK_SIZE, Host::MAX_OBJECT_SIZE,
+			Host::Provider() };
+	};
+
+public:
+	class Ref
+	{
+		SmallObjAllocator* heap_;
+
+		Ref(const Ref&) = delete;
+		Ref& operator=(const Ref&) = delete;
+
+	public:
+		Ref()
+			: heap_(&Singleton<Instance>::GetInstance().heap)
+		{
+		}
+
+		SmallObjAllocator* operator->() const noexcept
+		{
+			return heap_;
+		}
+		SmallObjAllocator* Heap() const noexcept
+		{
+			return heap_;
+		}
+	};
+};
+
+// One heap shared by every thread, locked for the length of a call
+template <class Host>
+class ClassLevelLockable
+{
+	struct Instance
+	{
+		SmallObjAllocator heap{ Host::CHUNK_SIZE, Host::MAX_OBJECT_SIZE,
+			Host::Provider() };
+		std::mutex mutex;
+	};
+
+public:
+	class Ref
+	{
+		Instance& instance_;
+		std::lock_guard<std::mutex> lock_;
+
+		Ref(const Ref&) = delete;
+		Ref& operator=(const Ref&) = delete;
+
+	public:
+		Ref()
+			: instance_(Singleton<Instance>::GetInstance())
+			, lock_(instance_.mutex)
+		{
+		}
+
+		SmallObjAllocator* operator->() const noexcept
+		{
+			return &instance_.heap;
+		}
+		SmallObjAllocator* Heap() const noexcept
+		{
+			return &instance_.heap;
+		}
+	};
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// class AllocatorSingleton
+// A pool of heaps of its own, configured at compile time: how threads share
+//     them, the chunk size, the largest object pooled and where the pages
+//     come from. Give it to soalloc<T> as its Pool
+// Every configuration is a separate pool, 'Tag' separates pools configured
+//     alike. Blocks of any pool or of ThreadHeap may be freed through any
+//     other, they go back to the heap they came from
+////////////////////////////////////////////////////////////////////////////////
+
+template <template <class> class ThreadingModel = PerThread,
+	std::size_t chunkSize = DEFAULT_CHUNK_SIZE,
+	std::size_t maxSmallObjectSize = MAX_SMALL_OBJECT_SIZE,
+	class PageSource = DefaultPageSource,
+	class Tag = void>
+class AllocatorSingleton
+{
+	struct Heaps : HeapRegistry
+	{
+		Heaps()
+			: HeapRegistry(CHUNK_SIZE, MAX_OBJECT_SIZE, PageSource::Provider())
+		{
+		}
+	};
+
+	static_assert(SizeClassOf(maxSmallObjectSize) <=
+		std::numeric_limits<unsigned char>::max(),
+		"maxSmallObjectSize has too many size classes");
+
+public:
+	static constexpr std::size_t CHUNK_SIZE = chunkSize;
+	static constexpr std::size_t MAX_OBJECT_SIZE = maxSmallObjectSize;
+
+	static PageProvider* Provider()
+	{
+		return PageSource::Provider();
+	}
+
+	// Heaps of the PerThread model
+	static HeapRegistry& Registry() noexcept
+	{
+		return Singleton<Heaps>::GetInstance();
+	}
+
+	typedef typename ThreadingModel<AllocatorSingleton>::Ref Ref;
+
+	// The heap the calling thread may use while the Ref lives
+	static Ref Get()
+	{
+		return Ref();
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// class soalloc_region
+// Monotonic region: hands out memory of whole chunks lent by the heap of the
+//     calling thread and frees all of it at once when destroyed, giving the
+//     chunks back to the heap
+// Deleting an object of a region only runs its destructor, the region itself
+//     runs none
+// While alive a region is the current one of its thread, and the
+//     soalloc_regional classes small enough for a heap are allocated in it.
+//     Regions nest and are destroyed by their thread in reverse order
+////////////////////////////////////////////////////////////////////////////////
+
+class soalloc_region
+{
+	// An allocation too large for a chunk, from operator new
+	struct LargeBlock
+	{
+		LargeBlock* next;
+		std::size_t alignment;
+	};
+
+	void* AllocateSlow(std::size_t numBytes, std::size_t alignment);
+
+	SmallObjAllocator* heap_;
+	soalloc_region* previous_;
+	// Data of the lent chunks, linked through their first word
+	void* chunks_;
+	LargeBlock* large_;
+	unsigned char* next_;
+	unsigned char* end_;
+
+	static inline thread_local soalloc_region* current_ = nullptr;
+
+	soalloc_region(const soalloc_region&) = delete;
+	soalloc_region& operator=(const soalloc_region&) = delete;
+
+public:
+	soalloc_region();
+	~soalloc_region();
+
+	// 'alignment' is a power of two
+	void* Allocate(std::size_t numBytes,
+		std::size_t alignment = SmallObjAllocator::BLOCK_ALIGNMENT)
+	{
+		if (alignment <= SmallObjAllocator::BLOCK_ALIGNMENT &&
+			numBytes < static_cast<std::size_t>(end_ - next_))
+		{
+			// Chunk data and every size handed out are multiples of 16
+			void* p = next_;
+			next_ += ((numBytes ? numBytes : 1) + 15) & ~std::size_t(15);
+			return p;
+		}
+		return AllocateSlow(numBytes, alignment);
+	}
+
+	// The innermost region of the calling thread, nullptr if none
+	static soalloc_region* Current() noexcept
+	{
+		return current_;
+	}
+};
+
+// 'Alignment' is the least alignment of every object, raise it to
+//     SOALLOC_CACHE_LINE_SIZE through soalloc_isolated
+// 'Regional' objects are allocated in the current soalloc_region if there is
+//     one, see soalloc_regional
+// 'Pool' gives the heaps, ThreadHeap or an AllocatorSingleton
+template<typename T, std::size_t Alignment = SmallObjAllocator::BLOCK_ALIGNMENT,
+	bool Regional = false, class Pool = ThreadHeap>
+class soalloc
+{
+	static typename Pool::Ref getSmallObjAllocator()
+	{
+		return Pool::Get();
+	}
+
+	static std::size_t alignmentOf(std::align_val_t alignment)
+	{
+		return static_cast<std::size_t>(alignment) > Alignment ?
+			static_cast<std::size_t>(alignment) : Alignment;
+	}
+
+	// Alignment and size of T itself, rounded up to its alignment
+	// Functions rather than constants, T is not complete yet where soalloc<T>
+	// is instantiated as its base
+	static constexpr std::size_t typeAlignment()
+	{
+		return alignof(T) > Alignment ? alignof(T) : Alignment;
+	}
+	static constexpr std::size_t typeSize()
+	{
+		return (sizeof(T) + typeAlignment() - 1) & ~(typeAlignment() - 1);
+	}
+	// Whether T comes from a size class of the heap
+	static constexpr bool typePooled()
+	{
+		return typeSize() <= Pool::MAX_OBJECT_SIZE &&
+			typeAlignment() <= SmallObjAllocator::MAX_BLOCK_ALIGNMENT;
+	}
+
+	static void* alloc(size_t size, std::size_t alignment, bool nothrow = false)
 	{
 		if (size == 0) size = 1;
 
-		SmallObjAllocator* pSmallObjAllocator = getSmallObjAllocator();
+		// Larger or more strictly aligned objects are freed by size without
+		// looking for a region, a region would give them a block of its own
+		if (Regional && size <= MAX_SMALL_OBJECT_SIZE &&
+			size <= Pool::MAX_OBJECT_SIZE &&
+			alignment <= SmallObjAllocator::MAX_BLOCK_ALIGNMENT)
+		{
+			if (soalloc_region* region = soalloc_region::Current())
+				return region->Allocate(size, alignment);
+		}
+
+#ifndef SOALLOC_TRACE
+		// T itself rather than a derived class: its size class is known at
+		// compile time, traced builds record every request on the path below
+		if constexpr (typePooled())
+		{
+			if (size == sizeof(T) && alignment == typeAlignment())
+			{
+				constexpr std::size_t sizeClass = SizeClassOf(typeSize());
+				return getSmallObjAllocator()->AllocateClass(sizeClass);
+			}
+		}
+#endif
 
-		void* ptr = pSmallObjAllocator->Allocate(size); //pSmallObjAllocator ? pSmallObjAllocator->Allocate(size) : nullptr;
+		void* ptr = alignment <= SmallObjAllocator::BLOCK_ALIGNMENT ?
+			getSmallObjAllocator()->Allocate(size) :
+			getSmallObjAllocator()->Allocate(size, alignment);
 		if (ptr == nullptr && !nothrow)
 		{
 			std::bad_alloc exception;
@@ -170,24 +1286,74 @@ class soalloc
 		}
 		return ptr;
 	}
-	static void free(void* ptr) noexcept
+	static void* alloc(size_t size, bool nothrow = false)
+	{
+		return alloc(size, Alignment, nothrow);
+	}
+	// 'size' is the size of the object deleted, of its dynamic type when the
+	// destructor is virtual; 0 when it is not known, then the heap recovers
+	// it from the chunk of the block
+	static void free(void* ptr, std::size_t size, std::size_t alignment) noexcept
 	{
 		if (ptr)
 		{
-			if (SmallObjAllocator * pSmallObjAllocator = getSmallObjAllocator())
-				pSmallObjAllocator->Deallocate(ptr, sizeof(T));
+			typename Pool::Ref pSmallObjAllocator = getSmallObjAllocator();
+			if (alignment > SmallObjAllocator::BLOCK_ALIGNMENT)
+				pSmallObjAllocator->Deallocate(ptr, size, alignment);
+			else if (size)
+				pSmallObjAllocator->Deallocate(ptr, size);
+			else
+				pSmallObjAllocator->Deallocate(ptr);
 		}
 	}
+	static void free(void* ptr, std::size_t size = 0) noexcept
+	{
+		free(ptr, size, Alignment);
+	}
 public:
+	// Allocates and constructs 'n' objects at once into 'out'
+	// If a constructor throws, the objects already built are destroyed
+	template <typename... Args>
+	static void newBatch(std::size_t n, T** out, const Args&... args)
+	{
+		const std::size_t alignment = alignof(T) > Alignment ? alignof(T) : Alignment;
+		void** blocks = reinterpret_cast<void**>(out);
+		// Not held across the constructors, they may allocate too
+		getSmallObjAllocator()->AllocateBatch(sizeof(T), n, blocks, alignment);
+		std::size_t i = 0;
+		try
+		{
+			for (; i < n; ++i)
+				out[i] = ::new (blocks[i]) T(args...);
+		}
+		catch (...)
+		{
+			while (i) out[--i]->~T();
+			getSmallObjAllocator()->DeallocateBatch(sizeof(T), blocks, n, alignment);
+			throw;
+		}
+	}
+	// Destroys and frees 'n' objects made by newBatch or new
+	static void deleteBatch(T** objects, std::size_t n) noexcept
+	{
+		const std::size_t alignment = alignof(T) > Alignment ? alignof(T) : Alignment;
+		for (std::size_t i = 0; i < n; ++i)
+			objects[i]->~T();
+		getSmallObjAllocator()->DeallocateBatch(sizeof(T),
+			reinterpret_cast<void**>(objects), n, alignment);
+	}
+
 	static void* operator new(size_t size) // throwing
 	{
 //		std::cout << "throwing operator new (" << typeid(T).name() << "), size: " << size << std::endl;
 		return alloc(size);
 	}
-	static void operator delete (void* ptr) noexcept // ordinary
+	// Sized, so that a derived class deleted through a base with a virtual
+	// destructor gives back its own size
+	static void operator delete (void* ptr, std::size_t size) noexcept // ordinary
 	{
 //		std::cout << "ordinary operator delete (" << typeid(T).name() << "): " << ptr << std::endl;
-		free(ptr);
+		free(ptr, size);
 	}
 	static void* operator new (std::size_t size, const std::nothrow_t& nothrow_value) noexcept // nothrow
 	{
@@ -206,6 +1372,30 @@ public:
 //		std::cout << "nothrow operator delete (" << typeid(T).name() << "): " << ptr << std::endl;
 		free(ptr);
 	}
+	// Over-aligned classes
+	static void* operator new(size_t size, std::align_val_t alignment)
+	{
+		return alloc(size, alignmentOf(alignment));
+	}
+	static void operator delete (void* ptr, std::size_t size, std::align_val_t alignment) noexcept
+	{
+		free(ptr, size, alignmentOf(alignment));
+	}
+	static void* operator new (std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+	{
+		try
+		{
+			return alloc(size, alignmentOf(alignment), true);
+		}
+		catch (...)
+		{
+			return nullptr;
+		}
+	}
+	static void operator delete (void* ptr, std::align_val_t alignment, const std::nothrow_t&) noexcept
+	{
+		free(ptr, 0, alignmentOf(alignment));
+	}
 	static void* operator new (std::size_t size, void* ptr) noexcept // placement
 	{
 //		std::cout << "placement operator new (" << typeid(T).name() << "), size: " << size << std::endl;
@@ -219,22 +1409,52 @@ public:
 	static void* operator new[](size_t size) // throwing
 	{
 //		std::cout << "throwing operator new[] (" << typeid(T).name() << "): " << size << std::endl;
-		return ::operator new[](size);
+		return alloc(size);
 	}
 	static void operator delete[](void* ptr) noexcept // ordinary
 	{
 //		std::cout << "ordinary operator delete[] (" << typeid(T).name() << "): " << ptr << std::endl;
-		::operator delete[](ptr);
+		free(ptr);
 	}
 	static void* operator new[](std::size_t size, const std::nothrow_t& nothrow_value) noexcept // nothrow
 	{
 //		std::cout << "nothrow operator new[] (" << typeid(T).name() << "), size: " << size << std::endl;
-		return ::operator new[](size, nothrow_value);
+		try
+		{
+			return alloc(size, true);
+		}
+		catch (...)
+		{
+			return nullptr;
+		}
 	}
 	static void operator delete[](void* ptr, const std::nothrow_t& nothrow_constant) noexcept
 	{
 //		std::cout << "nothrow operator delete[] (" << typeid(T).name() << "): " << ptr << std::endl;
-		::operator delete[](ptr, nothrow_constant);
+		free(ptr);
+	}
+	static void* operator new[](size_t size, std::align_val_t alignment)
+	{
+		return alloc(size, alignmentOf(alignment));
+	}
+	static void operator delete[](void* ptr, std::align_val_t alignment) noexcept
+	{
+		free(ptr, 0, alignmentOf(alignment));
+	}
+	static void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+	{
+		try
+		{
+			return alloc(size, alignmentOf(alignment), true);
+		}
+		catch (...)
+		{
+			return nullptr;
+		}
+	}
+	static void operator delete[](void* ptr, std::align_val_t alignment, const std::nothrow_t&) noexcept
+	{
+		free(ptr, 0, alignmentOf(alignment));
 	}
 	static void* operator new[](std::size_t size, void* ptr) noexcept // placement
 	{
@@ -246,4 +1466,98 @@ public:
 //		std::cout << "placement operator delete[] (" << typeid(T).name() << "): " << ptr << std::endl;
 		return;
 	}
-};
\ No newline at end of file
+};
+
+// Base for hot objects written by several threads: every object has its own
+//     cache lines and shares none with its neighbours
+template <typename T, class Pool = ThreadHeap>
+using soalloc_isolated = soalloc<T, SOALLOC_CACHE_LINE_SIZE, false, Pool>;
+
+// Base for objects that die together, such as those built for a request:
+//     inside a soalloc_region they are allocated in it and cost nothing to
+//     free, outside one they come from the heap
+template <typename T>
+using soalloc_regional = soalloc<T, SmallObjAllocator::BLOCK_ALIGNMENT, true>;
+
+////////////////////////////////////////////////////////////////////////////////
+// class soalloc_allocator
+// Standard allocator taking memory from the SmallObjAllocator of the calling
+//     thread, so node based containers get pooled nodes
+// All instances are equal, memory may be freed by any thread
+////////////////////////////////////////////////////////////////////////////////
+
+template <typename T>
+class soalloc_allocator
+{
+public:
+	typedef T value_type;
+	typedef std::true_type is_always_equal;
+	typedef std::true_type propagate_on_container_move_assignment;
+
+	soalloc_allocator() noexcept = default;
+	template <typename U>
+	soalloc_allocator(const soalloc_allocator<U>&) noexcept {}
+
+	T* allocate(std::size_t n)
+	{
+		if (n > std::numeric_limits<std::size_t>::max() / sizeof(T))
+			throw std::bad_array_new_length();
+		if (alignof(T) > SmallObjAllocator::BLOCK_ALIGNMENT)
+			return static_cast<T*>(ThreadHeap::Get()->Allocate(n * sizeof(T),
+				alignof(T)));
+		return static_cast<T*>(ThreadHeap::Get()->Allocate(n * sizeof(T)));
+	}
+	void deallocate(T* p, std::size_t n) noexcept
+	{
+		if (alignof(T) > SmallObjAllocator::BLOCK_ALIGNMENT)
+			return ThreadHeap::Get()->Deallocate(p, n * sizeof(T), alignof(T));
+		ThreadHeap::Get()->Deallocate(p, n * sizeof(T));
+	}
+};
+
+template <typename T, typename U>
+bool operator==(const soalloc_allocator<T>&, const soalloc_allocator<U>&) noexcept
+{
+	return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const soalloc_allocator<T>&, const soalloc_allocator<U>&) noexcept
+{
+	return false;
+}
+
+#ifdef SOALLOC_HAS_MEMORY_RESOURCE
+
+////////////////////////////////////////////////////////////////////////////////
+// class soalloc_memory_resource
+// std::pmr::memory_resource over the SmallObjAllocator of the calling thread
+// Stateless, so all instances compare equal
+////////////////////////////////////////////////////////////////////////////////
+
+class soalloc_memory_resource : public std::pmr::memory_resource
+{
+public:
+	// A shared instance, never destroyed
+	static soalloc_memory_resource* Get() noexcept
+	{
+		static soalloc_memory_resource* resource = new soalloc_memory_resource;
+		return resource;
+	}
+
+private:
+	void* do_allocate(std::size_t bytes, std::size_t alignment) override
+	{
+		return ThreadHeap::Get()->Allocate(bytes, alignment);
+	}
+	void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override
+	{
+		ThreadHeap::Get()->Deallocate(p, bytes, alignment);
+	}
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+	{
+		return dynamic_cast<const soalloc_memory_resource*>(&other) != nullptr;
+	}
+};
+
+#endif
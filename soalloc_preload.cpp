@@ -0,0 +1,347 @@
+// This is an open source non-commercial project. Dear PVS-Studio, please check it.
+
+// PVS-Studio Static Code Analyzer for C, C++ and C#: http://www.viva64.com
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//	soalloc_preload
+//	Replaces the global operator new/delete and, with SOALLOC_REPLACE_MALLOC,
+//	malloc, free, calloc, realloc, posix_memalign and malloc_usable_size
+//	Requests up to MAX_SMALL_OBJECT_SIZE aligned to at most a cache line are
+//	served by the SmallObjAllocator of the calling thread, everything else by
+//	the C library
+//
+//	LD_PRELOAD=libsoalloc_preload.so application
+//
+//	Memory is told apart by address: a block found in no chunk belongs to
+//	the C library. Allocations soalloc makes for itself (chunk lists, page
+//	map nodes, the heap registry) go to the C library too
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <dlfcn.h>
+#include <pthread.h>
+#include "soalloc.h"
+
+#ifdef SOALLOC_REPLACE_MALLOC
+extern "C"
+{
+	void* __libc_malloc(std::size_t size);
+	void __libc_free(void* p);
+	void* __libc_calloc(std::size_t n, std::size_t size);
+	void* __libc_realloc(void* p, std::size_t size);
+	void* __libc_memalign(std::size_t alignment, std::size_t size);
+}
+#endif
+
+namespace
+{
+
+// Guaranteed by malloc and by operator new without an alignment
+const std::size_t DEFAULT_ALIGNMENT = alignof(std::max_align_t);
+
+void* FallbackAllocate(std::size_t size) noexcept
+{
+#ifdef SOALLOC_REPLACE_MALLOC
+	return __libc_malloc(size);
+#else
+	return std::malloc(size);
+#endif
+}
+
+void* FallbackAllocate(std::size_t size, std::size_t alignment) noexcept
+{
+#ifdef SOALLOC_REPLACE_MALLOC
+	return __libc_memalign(alignment, size);
+#else
+	if (alignment < sizeof(void*)) alignment = sizeof(void*);
+	void* p;
+	return ::posix_memalign(&p, alignment, size) == 0 ? p : nullptr;
+#endif
+}
+
+void FallbackFree(void* p) noexcept
+{
+#ifdef SOALLOC_REPLACE_MALLOC
+	__libc_free(p);
+#else
+	std::free(p);
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// PoolAllocate
+// Returns a block from the heap of the calling thread, nullptr if 'size' is
+//     not small, 'alignment' is above a cache line or the thread is already
+//     inside soalloc
+////////////////////////////////////////////////////////////////////////////////
+
+void* PoolAllocate(std::size_t size, std::size_t alignment) noexcept
+{
+	if (size > MAX_SMALL_OBJECT_SIZE ||
+		alignment > SmallObjAllocator::MAX_BLOCK_ALIGNMENT || ThreadHeap::Inside())
+		return nullptr;
+
+	ThreadHeap::Scope scope;
+	try
+	{
+		return ThreadHeap::Get()->Allocate(size, alignment);
+	}
+	catch (...)
+	{
+		return nullptr;
+	}
+}
+
+void* Allocate(std::size_t size) noexcept
+{
+	void* p = PoolAllocate(size, DEFAULT_ALIGNMENT);
+	return p ? p : FallbackAllocate(size);
+}
+
+void* Allocate(std::size_t size, std::size_t alignment) noexcept
+{
+	if (alignment <= DEFAULT_ALIGNMENT) return Allocate(size);
+	void* p = PoolAllocate(size, alignment);
+	return p ? p : FallbackAllocate(size, alignment);
+}
+
+void Free(void* p) noexcept
+{
+	if (p == nullptr) return;
+	if (FixedAllocator::OwnerOf(p) == nullptr) return FallbackFree(p);
+
+	// soalloc frees only the memory it allocated for itself while inside
+	assert(!ThreadHeap::Inside());
+	ThreadHeap::Scope scope;
+	ThreadHeap::Get()->Deallocate(p);
+}
+
+// The throwing operator new loop: retry through the new handler
+void* AllocateOrThrow(std::size_t size, std::size_t alignment)
+{
+	for (;;)
+	{
+		if (void* p = Allocate(size, alignment)) return p;
+		std::new_handler handler = std::get_new_handler();
+		if (handler == nullptr) throw std::bad_alloc();
+		handler();
+	}
+}
+
+void* AllocateNothrow(std::size_t size, std::size_t alignment) noexcept
+{
+	try
+	{
+		return AllocateOrThrow(size, alignment);
+	}
+	catch (...)
+	{
+		return nullptr;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// RegisterForkHandlers
+// Runs when the library is loaded. A thread holding a lock of soalloc while
+//     another forks would leave it held in the child, whose first slow path
+//     allocation would then wait forever
+////////////////////////////////////////////////////////////////////////////////
+
+__attribute__((constructor)) void RegisterForkHandlers()
+{
+	::pthread_atfork(ThreadHeap::PrepareFork, ThreadHeap::AfterFork,
+		ThreadHeap::AfterFork);
+}
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Global operator new/delete
+////////////////////////////////////////////////////////////////////////////////
+
+void* operator new(std::size_t size)
+{
+	return AllocateOrThrow(size, DEFAULT_ALIGNMENT);
+}
+
+void* operator new[](std::size_t size)
+{
+	return AllocateOrThrow(size, DEFAULT_ALIGNMENT);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+	return AllocateNothrow(size, DEFAULT_ALIGNMENT);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+	return AllocateNothrow(size, DEFAULT_ALIGNMENT);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+	return AllocateOrThrow(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment)
+{
+	return AllocateOrThrow(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment,
+	const std::nothrow_t&) noexcept
+{
+	return AllocateNothrow(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment,
+	const std::nothrow_t&) noexcept
+{
+	return AllocateNothrow(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* p) noexcept
+{
+	Free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+	Free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+	Free(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept
+{
+	Free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+	Free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+	Free(p);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept
+{
+	Free(p);
+}
+
+void operator delete[](void* p, std::align_val_t) noexcept
+{
+	Free(p);
+}
+
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept
+{
+	Free(p);
+}
+
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept
+{
+	Free(p);
+}
+
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	Free(p);
+}
+
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	Free(p);
+}
+
+#ifdef SOALLOC_REPLACE_MALLOC
+
+////////////////////////////////////////////////////////////////////////////////
+// The malloc family
+// aligned_alloc, memalign and valloc are left to the C library, free tells
+//     their blocks apart like any other
+////////////////////////////////////////////////////////////////////////////////
+
+extern "C"
+{
+
+void* malloc(std::size_t size) noexcept
+{
+	return Allocate(size);
+}
+
+void free(void* p) noexcept
+{
+	Free(p);
+}
+
+void* calloc(std::size_t n, std::size_t size) noexcept
+{
+	if (size && n > static_cast<std::size_t>(-1) / size)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+	if (void* p = PoolAllocate(n * size, DEFAULT_ALIGNMENT))
+		return std::memset(p, 0, n * size);
+	return __libc_calloc(n, size);
+}
+
+void* realloc(void* p, std::size_t size) noexcept
+{
+	if (p == nullptr) return Allocate(size);
+
+	FixedAllocator* owner = FixedAllocator::OwnerOf(p);
+	if (owner == nullptr) return __libc_realloc(p, size);
+	if (size == 0)
+	{
+		Free(p);
+		return nullptr;
+	}
+	if (size <= owner->BlockSize()) return p;
+
+	void* q = Allocate(size);
+	if (q == nullptr) return nullptr;
+	std::memcpy(q, p, owner->BlockSize());
+	Free(p);
+	return q;
+}
+
+int posix_memalign(void** result, std::size_t alignment, std::size_t size) noexcept
+{
+	if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0)
+		return EINVAL;
+	void* p = Allocate(size, alignment);
+	if (p == nullptr) return ENOMEM;
+	*result = p;
+	return 0;
+}
+
+std::size_t malloc_usable_size(void* p) noexcept
+{
+	if (p == nullptr) return 0;
+	if (FixedAllocator* owner = FixedAllocator::OwnerOf(p))
+		return owner->BlockSize();
+
+	typedef std::size_t (*UsableSize)(void*);
+	static UsableSize next =
+		reinterpret_cast<UsableSize>(::dlsym(RTLD_NEXT, "malloc_usable_size"));
+	return next ? next(p) : 0;
+}
+
+}
+
+#endif